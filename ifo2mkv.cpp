@@ -17,306 +17,2442 @@
  Written by Moritz Bunkus <moritz@bunkus.org>.
  */
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
-#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <format>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
-#include <random>
-#include <stdexcept>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
-#include <dvdread/dvd_reader.h>
-#include <dvdread/ifo_read.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libifo2mkv_internal.h"
+
+using namespace ifo2mkv;
 
 namespace
 {
-struct libdvdread_logger : public dvd_logger_cb
+enum class output_mode
+{
+  chapters,
+  summary_table,
+  summary_ndjson,
+  sectors,
+  streams,
+};
+
+struct shard_spec
+{
+  unsigned index = 0;
+  unsigned count = 1;
+};
+
+struct options
+{
+  char const *path = nullptr;
+  output_mode mode = output_mode::chapters;
+  chapter_times times = chapter_times::ifo;
+  std::optional<fingerprint_kind> fingerprint;
+  unsigned title = 0;
+  bool main_only = false;
+  bool skip_decoys = false;
+  char const *batch_list = nullptr;
+  char const *merge_list = nullptr;
+  std::vector<char const *> merge_inputs;
+  char const *output = nullptr;
+  std::optional<shard_spec> shard;
+  char const *journal = nullptr;
+  unsigned journal_sync = 64;
+  unsigned jobs = 1;
+  unsigned io_limit = 0;
+  char const *stats = nullptr;
+  bool perf = false;
+  size_t reorder_buffer_mib = 64;
+  bool unordered = false;
+  std::optional<std::chrono::seconds> timeout;
+  unsigned retries = 1;
+  bool isolate = false;
+  bool pool_worker = false;
+  char **argv = nullptr;
+  char const *trace = nullptr;
+  char const *vob = nullptr;
+  char const *dedup_index = nullptr;
+  bool direct_io = false;
+  unsigned readahead = 0;
+};
+
+// Opens the file output should go to, or returns nullptr for stdout.
+std::unique_ptr<std::ofstream> open_output(std::string const &path)
+{
+  if (path.empty())
+  {
+    return nullptr;
+  }
+  auto out = std::make_unique<std::ofstream>(path, std::ios::binary | std::ios::trunc);
+  if (!*out)
+  {
+    throw disc_exception(std::format("Could not open output file {}", path));
+  }
+  return out;
+}
+
+// FNV-1a, which is the same on every machine and in every run : every node of
+// a sharded run agrees on the partitioning without any coordination, and dedup
+// indexes can be shared.
+uint64_t fnv1a(std::string_view str)
+{
+  auto hash = uint64_t{0xcbf29ce484222325};
+  for (auto c : str)
+  {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// Index of the discs and titles batch runs have seen, for finding the copies
+// of the same disc in an archive. PATH holds an open addressing hash table of
+// 16 byte slots which is mapped into memory : a lookup costs a probe or two
+// however many titles are indexed, and how much of it stays in memory is up to
+// the page cache. Slots hold a hash of a key and refer to an entry of
+// PATH.records, which holds the key itself; entries are appended before the
+// slot is filled in so that a crash at worst loses the last entries. A disc is
+// keyed by its fingerprint together with the output options, as its output is
+// only reusable by runs asking for the same, and its entry holds its path and
+// output. A title is keyed by its structural signature, and its entry holds the
+// path of the disc and the title number.
+struct dedup_index
 {
-  libdvdread_logger()
+  struct disc_entry
+  {
+    std::string path;
+    std::string record;
+  };
+
+  struct title_match
+  {
+    int title;
+    std::string other_disc;
+    int other_title;
+  };
+
+  dedup_index(char const *path, std::string options)
+      : path_(path), options_(std::move(options)),
+        records_(open_file(std::format("{}.records", path).c_str(), O_RDWR | O_CREAT | O_APPEND))
+  {
+    struct stat st;
+    if (::flock(records_.get(), LOCK_EX | LOCK_NB) != 0)
+    {
+      throw disc_exception(std::format("Dedup index {} is in use by another run", path_));
+    }
+    if (::fstat(records_.get(), &st) != 0)
+    {
+      throw stream_exception(std::format("Failed to stat {}.records : {}", path_, std::strerror(errno)));
+    }
+    records_size_ = static_cast<uint64_t>(st.st_size);
+
+    auto fd = open_file(path, O_RDWR | O_CREAT);
+    if (::fstat(fd.get(), &st) != 0)
+    {
+      throw stream_exception(std::format("Failed to stat {} : {}", path_, std::strerror(errno)));
+    }
+    if (st.st_size == 0)
+    {
+      table_ = table::create(std::move(fd), initial_capacity);
+    }
+    else
+    {
+      table_ = std::make_unique<table>(std::move(fd), static_cast<size_t>(st.st_size));
+      auto const &head = table_->head();
+      if (std::string_view{head.magic, sizeof(head.magic)} != std::string_view{magic, sizeof(magic)} ||
+          std::popcount(head.capacity) != 1 || table::file_size(head.capacity) != static_cast<uint64_t>(st.st_size))
+      {
+        throw disc_exception(std::format("{} is not a dedup index", path_));
+      }
+      if (head.version != version)
+      {
+        throw disc_exception(std::format("Dedup index {} was made by another version of ifo2mkv", path_));
+      }
+    }
+  }
+
+  // Returns the disc indexed with the same fingerprint, if any.
+  std::optional<disc_entry> find_disc(std::string_view fingerprint)
   {
-    this->pf_log = pf_log_;
+    auto const key = disc_key(fingerprint);
+    auto const lock = std::lock_guard{mutex_};
+    auto entry = find(key);
+    if (!entry)
+    {
+      return std::nullopt;
+    }
+    ++num_reused_;
+    return disc_entry{std::move(entry->path), std::move(entry->record)};
   }
-  ~libdvdread_logger()
+
+  // Indexes a disc along with the signatures of its titles, given as pairs of
+  // title number and signature. Returns the titles other discs hold as well.
+  std::vector<title_match> add_disc(std::string_view fingerprint, std::string_view path, std::string_view record,
+                                    std::vector<std::pair<int, uint64_t>> const &titles)
   {
-    if (do_report_messages_)
+    auto const key = disc_key(fingerprint);
+    auto const lock = std::lock_guard{mutex_};
+    if (find(key))
+    {
+      // Another worker got to a copy of the disc first.
+      return {};
+    }
+    auto const offset = append_entry(key, path, record);
+    insert(key, offset);
+
+    auto matches = std::vector<title_match>{};
+    for (auto const &[title, signature] : titles)
     {
-      std::cerr << "Messages reported by libdvdread :\n";
-      for (auto &&msg : messages_)
+      auto const title_key = std::format("title {:016x}", signature);
+      if (auto const entry = find(title_key))
       {
-        std::cerr << std::format("[{}] {}\n", lvl_to_str(msg.first), msg.second);
+        // Entries past the disc's own are those of its other titles.
+        if (entry->offset < offset)
+        {
+          auto other_title = 0;
+          std::from_chars(entry->record.data(), entry->record.data() + entry->record.size(), other_title);
+          matches.push_back({title, entry->path, other_title});
+        }
       }
+      else
+      {
+        insert(title_key, append_entry(title_key, path, std::to_string(title)));
+      }
+    }
+    return matches;
+  }
+
+  void sync()
+  {
+    auto const lock = std::lock_guard{mutex_};
+    table_->sync();
+    if (::fdatasync(records_.get()) != 0)
+    {
+      throw stream_exception(std::format("Failed syncing {}.records : {}", path_, std::strerror(errno)));
     }
   }
 
-  void disable_report()
+  unsigned num_reused() const
   {
-    do_report_messages_ = false;
+    return num_reused_;
   }
 
 private:
-  static std::string_view lvl_to_str(dvd_logger_level_t lvl)
-  {
-    switch (lvl)
-    {
-    case DVD_LOGGER_LEVEL_INFO:
-      return "INFO";
-    case DVD_LOGGER_LEVEL_ERROR:
-      return "ERROR";
-    case DVD_LOGGER_LEVEL_WARN:
-      return "WARN";
-    case DVD_LOGGER_LEVEL_DEBUG:
-      return "DEBUG";
-    default:
-      return "unknown";
+  static constexpr char magic[8] = {'i', 'f', 'o', '2', 'm', 'k', 'v', 'X'};
+  // Indexes of version 0 packed title numbers into the slots of titles.
+  static constexpr uint64_t version = 1;
+  static constexpr uint64_t initial_capacity = 1u << 16;
+
+  struct table_header
+  {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t version;
+  };
+
+  struct table_slot
+  {
+    uint64_t key; // 0 for empty slots
+    uint64_t value;
+  };
+
+  struct table
+  {
+    table(unique_fd fd, size_t size)
+        : fd_(std::move(fd)), size_(size),
+          data_(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.get(), 0))
+    {
+      if (data_ == MAP_FAILED)
+      {
+        throw stream_exception(std::format("Failed to map dedup index : {}", std::strerror(errno)));
+      }
+    }
+    table(table const &) = delete;
+    table &operator=(table const &) = delete;
+    ~table()
+    {
+      ::munmap(data_, size_);
+    }
+
+    static uint64_t file_size(uint64_t capacity)
+    {
+      return sizeof(table_header) + capacity * sizeof(table_slot);
+    }
+
+    static std::unique_ptr<table> create(unique_fd fd, uint64_t capacity)
+    {
+      if (::ftruncate(fd.get(), static_cast<off_t>(file_size(capacity))) != 0)
+      {
+        throw stream_exception(std::format("Failed to size dedup index : {}", std::strerror(errno)));
+      }
+      auto created = std::make_unique<table>(std::move(fd), file_size(capacity));
+      auto &head = created->head();
+      std::copy(std::begin(magic), std::end(magic), head.magic);
+      head.capacity = capacity;
+      head.version = version;
+      return created;
+    }
+
+    table_header &head()
+    {
+      return *static_cast<table_header *>(data_);
+    }
+
+    table_slot *slots()
+    {
+      return reinterpret_cast<table_slot *>(static_cast<char *>(data_) + sizeof(table_header));
+    }
+
+    // Returns the slot holding key for which match is true, or the empty one
+    // it goes to. Different keys may share a hash, which match tells apart.
+    template <typename Match> table_slot &probe(uint64_t key, Match &&match)
+    {
+      auto const mask = head().capacity - 1;
+      for (auto i = key & mask;; i = (i + 1) & mask)
+      {
+        if (slots()[i].key == 0 || (slots()[i].key == key && match(slots()[i])))
+        {
+          return slots()[i];
+        }
+      }
+    }
+
+    table_slot &probe_empty(uint64_t key)
+    {
+      return probe(key, [](table_slot const &) { return false; });
+    }
+
+    void sync()
+    {
+      if (::msync(data_, size_, MS_SYNC) != 0)
+      {
+        throw stream_exception(std::format("Failed syncing dedup index : {}", std::strerror(errno)));
+      }
+    }
+
+  private:
+    unique_fd fd_;
+    size_t size_;
+    void *data_;
+  };
+
+  struct records_entry
+  {
+    uint64_t offset;
+    std::string key;
+    std::string path;
+    std::string record;
+  };
+
+  struct records_entry_header
+  {
+    uint32_t key_size;
+    uint32_t path_size;
+    uint64_t record_size;
+  };
+
+  std::string disc_key(std::string_view fingerprint) const
+  {
+    return std::format("disc {} {}", fingerprint, options_);
+  }
+
+  // With 0 moved out of the way of empty slots.
+  static uint64_t hash_of(std::string_view key)
+  {
+    auto const hash = fnv1a(key);
+    return hash ? hash : 1;
+  }
+
+  // Returns the entry indexed under key, if any.
+  std::optional<records_entry> find(std::string_view key)
+  {
+    auto entry = std::optional<records_entry>{};
+    auto const &slot = table_->probe(hash_of(key), [&](table_slot const &candidate) {
+      entry = read_entry(candidate.value);
+      return entry->key == key;
+    });
+    if (!slot.key)
+    {
+      return std::nullopt;
+    }
+    return entry;
+  }
+
+  // Tables are kept at most half full, doubling their capacity when needed.
+  // The grown table is written next to the index and renamed over it.
+  void insert(std::string_view key_string, uint64_t value)
+  {
+    auto const key = hash_of(key_string);
+    if ((table_->head().count + 1) * 2 > table_->head().capacity)
+    {
+      auto const tmp_path = path_ + ".tmp";
+      auto const capacity = table_->head().capacity;
+      auto grown = table::create(open_file(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC), capacity * 2);
+      for (auto i = uint64_t{0}; i < capacity; ++i)
+      {
+        if (auto const &slot = table_->slots()[i]; slot.key)
+        {
+          grown->probe_empty(slot.key) = slot;
+        }
+      }
+      grown->head().count = table_->head().count;
+      grown->sync();
+      if (::rename(tmp_path.c_str(), path_.c_str()) != 0)
+      {
+        throw stream_exception(std::format("Failed to replace {} : {}", path_, std::strerror(errno)));
+      }
+      table_ = std::move(grown);
     }
+    table_->probe_empty(key) = {key, value};
+    ++table_->head().count;
   }
 
-  static void pf_log_(void *p, dvd_logger_level_t lvl, char const *fmt, va_list args)
+  uint64_t append_entry(std::string_view key, std::string_view path, std::string_view record)
   {
-    char msg[16 * 1024];
-    auto const num_written = ::vsnprintf(msg, sizeof(msg), fmt, args);
-    if (num_written >= 0)
+    auto const header = records_entry_header{static_cast<uint32_t>(key.size()), static_cast<uint32_t>(path.size()),
+                                             record.size()};
+    auto data = std::string{reinterpret_cast<char const *>(&header), sizeof(header)};
+    data.append(key).append(path).append(record);
+    for (auto left = std::string_view{data}; !left.empty();)
     {
-      auto const sv_length =
-          static_cast<std::string_view::size_type>(std::min(num_written, static_cast<int>(sizeof(msg) - 1)));
-      static_cast<libdvdread_logger *>(p)->real_log(lvl, std::string_view{msg, sv_length});
+      auto const ret = ::write(records_.get(), left.data(), left.size());
+      if (ret < 0 && errno != EINTR)
+      {
+        throw stream_exception(std::format("Failed writing {}.records : {}", path_, std::strerror(errno)));
+      }
+      left.remove_prefix(ret < 0 ? 0 : static_cast<size_t>(ret));
     }
+    return std::exchange(records_size_, records_size_ + data.size());
   }
-  void real_log(dvd_logger_level_t lvl, std::string_view str)
+
+  records_entry read_entry(uint64_t offset) const
   {
-    messages_.emplace_back(std::make_pair(lvl, str));
+    auto header = records_entry_header{};
+    auto const read_at = [&](void *buffer, size_t size, uint64_t pos) {
+      if (::pread(records_.get(), buffer, size, static_cast<off_t>(pos)) != static_cast<ssize_t>(size))
+      {
+        throw stream_exception(std::format("Failed reading {}.records at byte {}", path_, pos));
+      }
+    };
+    read_at(&header, sizeof(header), offset);
+    auto data = std::string(header.key_size + header.path_size + header.record_size, '\0');
+    read_at(data.data(), data.size(), offset + sizeof(header));
+    return {offset, data.substr(0, header.key_size), data.substr(header.key_size, header.path_size),
+            data.substr(header.key_size + header.path_size)};
   }
 
-  std::vector<std::pair<dvd_logger_level_t, std::string>> messages_;
-  bool do_report_messages_ = true;
+  std::string path_;
+  std::string options_;
+  unique_fd records_;
+  uint64_t records_size_ = 0;
+  std::unique_ptr<table> table_;
+  std::mutex mutex_;
+  unsigned num_reused_ = 0;
 };
 
-struct libdvdread_exception : public std::runtime_error
+// Makes a record indexed for another copy of the disc read as if made for
+// this one. Only NDJSON output names the disc.
+std::string rename_record(std::string record, std::string_view from, std::string_view to)
 {
-  libdvdread_exception(std::string const &what) : runtime_error(what)
+  auto const old_field = std::format(R"("disc":"{}")", json_escape(from));
+  auto const new_field = std::format(R"("disc":"{}")", json_escape(to));
+  for (auto pos = record.find(old_field); pos != std::string::npos; pos = record.find(old_field, pos))
   {
+    record.replace(pos, old_field.size(), new_field);
+    pos += new_field.size();
   }
-};
+  return record;
+}
+
+// Output built up in a per-disc arena rather than on the heap.
+using pmr_ostringstream = std::basic_ostringstream<char, std::char_traits<char>, std::pmr::polymorphic_allocator<char>>;
 
-using dvd_uptr = std::unique_ptr<dvd_reader_t, decltype(&::DVDClose)>;
-auto dvd_open(char const *path, libdvdread_logger &logger)
+void extract_disc(options const &opts, char const *path, dvd_stream *stream, libdvdread_logger &logger,
+                  std::optional<deadline_clock::time_point> deadline, std::ostream &out, std::pmr::memory_resource *mr,
+                  dedup_index *index)
 {
-  if (auto const dvd = ::DVDOpen2(&logger, &logger, path))
+  auto check_deadline = [&] {
+    if (deadline && deadline_clock::now() > *deadline)
+    {
+      throw timeout_exception("Deadline passed");
+    }
+  };
+
+  auto const perf = perf_scope{perf_compute};
+  auto dvd = disc{path, stream, logger, mr};
+
+  auto const num_titles = dvd.num_titles();
+  if (opts.title > static_cast<unsigned>(num_titles))
+  {
+    throw disc_exception(std::format("Title {} requested, but DVD has {} titles.", opts.title, num_titles));
+  }
+
+  auto const fingerprint = opts.fingerprint ? dvd.fingerprint(*opts.fingerprint) : std::string{};
+  auto const index_fingerprint = index && opts.fingerprint != fingerprint_kind::crc64
+                                     ? dvd.fingerprint(fingerprint_kind::crc64)
+                                     : fingerprint;
+  if (index)
+  {
+    if (auto const prior = index->find_disc(index_fingerprint))
+    {
+      if (prior->path != path)
+      {
+        std::cerr << std::format("{} : duplicate of {}, reusing its output\n", path, prior->path);
+      }
+      out << rename_record(prior->record, prior->path, path);
+      return;
+    }
+  }
+
+  auto titles = std::vector<int>{};
+  if (opts.title != 0u)
   {
-    return dvd_uptr{dvd, [](auto p) {
-                      if (p)
-                      {
-                        ::DVDClose(p);
-                      }
-                    }};
+    titles.push_back(static_cast<int>(opts.title) - 1);
   }
   else
   {
-    throw libdvdread_exception(std::format("Failed to open DVD structure under {}", path));
+    auto const skip = opts.skip_decoys ? dvd.find_decoy_titles(std::cerr) : std::vector<bool>(num_titles);
+    if (opts.main_only)
+    {
+      auto const main_title = dvd.find_main_title(skip);
+      if (main_title < 0)
+      {
+        throw disc_exception("No usable title found on the DVD.");
+      }
+      titles.push_back(main_title);
+    }
+    else
+    {
+      for (auto t = 0; t < num_titles; ++t)
+      {
+        if (!skip[t])
+        {
+          titles.push_back(t);
+        }
+      }
+    }
+  }
+
+  // Indexed discs have their output kept for reuse.
+  auto body = pmr_ostringstream{std::ios::out, mr};
+  auto &dest = index ? static_cast<std::ostream &>(body) : out;
+  auto write_summaries = [&](auto &&writer) {
+    for (auto t : titles)
+    {
+      check_deadline();
+      writer.on_title_summary(dvd.summary(t));
+    }
+  };
+  switch (opts.mode)
+  {
+  case output_mode::chapters: {
+    auto writer = matroska_chapter_xml_writer{dest, fingerprint};
+    for (auto t : titles)
+    {
+      check_deadline();
+      auto const span = trace_span{"get_chapters_for_title", "title", t + 1};
+      writer.on_title_chapters(dvd.chapters(t, opts.times));
+    }
+    break;
+  }
+  case output_mode::summary_table:
+    write_summaries(summary_table_writer{dest, fingerprint});
+    break;
+  case output_mode::summary_ndjson:
+    write_summaries(summary_ndjson_writer{dest, path, fingerprint, mr});
+    break;
+  case output_mode::streams: {
+    auto writer = streams_ndjson_writer{dest, path, fingerprint, mr};
+    for (auto t : titles)
+    {
+      check_deadline();
+      writer.on_title_streams(dvd.streams(t), dvd.chapters(t, opts.times));
+    }
+    break;
+  }
+  case output_mode::sectors: {
+    auto writer = sector_ndjson_writer{dest, path, fingerprint, mr};
+    for (auto t : titles)
+    {
+      check_deadline();
+      writer.on_title_sectors(dvd.sectors(t));
+    }
+    break;
+  }
+  }
+
+  if (index)
+  {
+    auto signatures = std::vector<std::pair<int, uint64_t>>{};
+    for (auto t : titles)
+    {
+      signatures.emplace_back(t + 1, dvd.title_signature(t));
+    }
+    for (auto const &match : index->add_disc(index_fingerprint, path, body.view(), signatures))
+    {
+      std::cerr << std::format("{} : title {} has the same structure as title {} of {}\n", path, match.title,
+                               match.other_title, match.other_disc);
+    }
+    out << body.view();
+  }
+
+  if (opts.vob)
+  {
+    auto const span = trace_span{"copy_title_vobs", "title", titles.front() + 1};
+    auto const vob_file = open_output(opts.vob == std::string_view{"-"} ? "" : opts.vob);
+    dvd.copy_title_vobs(titles.front(), vob_file ? *vob_file : std::cout);
   }
 }
 
-using ifo_uptr = std::unique_ptr<ifo_handle_t, decltype(&::ifoClose)>;
-auto ifo_open(dvd_reader_t &dvd, int title)
+void process_disc(options const &opts, char const *path, libdvdread_logger &logger, std::ostream &out,
+                  std::pmr::memory_resource *mr = std::pmr::get_default_resource(), dedup_index *index = nullptr)
 {
-  if (auto const ifo = ::ifoOpen(&dvd, title))
+  auto const deadline = opts.timeout ? std::optional{deadline_clock::now() + *opts.timeout} : std::nullopt;
+  auto const stream = [&] {
+    auto const perf = perf_scope{perf_open};
+    return make_stream(path, deadline, opts.direct_io);
+  }();
+  try
   {
-    return ifo_uptr{ifo, [](auto p) {
-                      if (p)
-                      {
-                        ::ifoClose(p);
-                      }
-                    }};
+    extract_disc(opts, path, stream.get(), logger, deadline, out, mr, index);
   }
-  else
+  catch (std::exception const &)
   {
-    throw libdvdread_exception(std::format("Failed to open IFO for title {}", title));
+    // libdvdread only sees failed reads, turn its errors back into a timeout.
+    if (stream && stream->timed_out())
+    {
+      throw timeout_exception(std::format("Timed out after {} s", opts.timeout->count()));
+    }
+    throw;
   }
 }
 
-struct matroska_chapter_xml_writer
+// Runs fn and reports whatever it throws on stderr, each message preceded by
+// prefix. Returns whether fn completed.
+template <typename Fn> bool report_errors(std::string_view prefix, Fn &&fn)
 {
-  matroska_chapter_xml_writer(std::ostream &stream) : rnd_gen_(std::random_device{}()), stream_(stream)
+  try
   {
-    stream_ << R"(<?xml version="1.0"?>
-<!-- <!DOCTYPE Chapters SYSTEM "matroskachapters.dtd"> -->
-<Chapters>
-)";
+    fn();
+    return true;
   }
-
-  ~matroska_chapter_xml_writer()
+  catch (disc_exception const &ex)
   {
-    stream_ << "</Chapters>\n";
+    std::cerr << prefix << ex.what() << '\n';
   }
-
-  void on_title_start()
+  catch (libdvdread_exception const &ex)
+  {
+    std::cerr << prefix << "DVD read error : " << ex.what() << '\n';
+  }
+  catch (stream_exception const &ex)
   {
-    stream_ << std::format(R"(  <EditionEntry>
-    <EditionFlagHidden>0</EditionFlagHidden>
-    <EditionFlagDefault>0</EditionFlagDefault>
-    <EditionFlagOrdered>0</EditionFlagOrdered>
-    <EditionUID>{}</EditionUID>
-)",
-                           rnd_gen_());
-    chapter_num_ = 1;
+    std::cerr << prefix << "Input error : " << ex.what() << '\n';
   }
-  void on_title_end()
+  catch (std::exception const &ex)
   {
-    stream_ << "  </EditionEntry>\n";
+    std::cerr << prefix << "Fatal error : " << ex.what() << '\n';
   }
-  void on_chapter_start(int32_t timestamp_ms)
+  catch (...)
   {
-    auto const hr = timestamp_ms / 3600000;
-    auto const min = (timestamp_ms / 60000) % 60;
-    auto const sec = (timestamp_ms / 1000) % 60;
-    auto const ms = timestamp_ms % 1000;
-    stream_ << std::format(R"(    <ChapterAtom>
-      <ChapterUID>{}</ChapterUID>
-      <ChapterTimeStart>{:02}:{:02}:{:02}.{:03}</ChapterTimeStart>
-      <ChapterDisplay>
-        <ChapterString>Chapter {:02}</ChapterString>
-        <ChapterLanguage>und</ChapterLanguage>
-        <ChapLanguageIETF>und</ChapLanguageIETF>
-      </ChapterDisplay>
-    </ChapterAtom>
-)",
-                           rnd_gen_(), hr, min, sec, ms, chapter_num_++);
+    std::cerr << prefix << "Unknown error\n";
   }
+  return false;
+}
 
-private:
-  std::mt19937_64 rnd_gen_;
-  std::ostream &stream_;
-  unsigned chapter_num_ = 1;
-};
+// In batch mode the output of each disc forms one record, introduced by a
+// header line naming the disc. The header cannot clash with any line of the
+// chapter XML, the summary table or NDJSON.
+constexpr std::string_view record_header_prefix = "#ifo2mkv disc ";
 
-int32_t frames_to_timestamp_ms(unsigned int num_frames, unsigned int fps)
+std::string record_header(std::string_view path)
 {
-  auto factor = fps == 30 ? 1001 : 1000;
-  return static_cast<int32_t>(factor * num_frames / (fps ? fps : 1));
+  return std::format("{}{}\n", record_header_prefix, path);
 }
 
-template <typename T> constexpr T from_bcd(T val)
+std::optional<std::string_view> parse_record_header(std::string_view line)
 {
-  return (((val & 0xf0) >> 4) * 10) + (val & 0x0f);
+  if (line.starts_with(record_header_prefix))
+  {
+    return line.substr(record_header_prefix.size());
+  }
+  return std::nullopt;
 }
 
-template <typename Writer> void get_chapters_for_title(dvd_reader_t &dvd, ifo_handle_t &vmg, int title, Writer &writer)
+std::vector<std::string> read_disc_list(char const *path)
 {
-  auto vts = ifo_open(dvd, vmg.tt_srpt->title[title].title_set_nr);
-
-  writer.on_title_start();
-  writer.on_chapter_start(0);
-
-  auto ttn = vmg.tt_srpt->title[title].vts_ttn;
-  auto vts_ptt_srpt = vts->vts_ptt_srpt;
-  auto overall_frames = 0u;
-  auto fps = 0u; // This should be consistent as DVDs are either NTSC or PAL
-
-  for (auto chapter = 0; chapter < vmg.tt_srpt->title[title].nr_of_ptts - 1; chapter++)
+  auto file = std::ifstream{};
+  if (path != std::string_view{"-"})
   {
-    auto pgc_id = vts_ptt_srpt->title[ttn - 1].ptt[chapter].pgcn;
-    auto pgn = vts_ptt_srpt->title[ttn - 1].ptt[chapter].pgn;
-    auto cur_pgc = vts->vts_pgcit->pgci_srp[pgc_id - 1].pgc;
-    auto start_cell = cur_pgc->program_map[pgn - 1] - 1;
-    pgc_id = vts_ptt_srpt->title[ttn - 1].ptt[chapter + 1].pgcn;
-    pgn = vts_ptt_srpt->title[ttn - 1].ptt[chapter + 1].pgn;
-    cur_pgc = vts->vts_pgcit->pgci_srp[pgc_id - 1].pgc;
-    auto end_cell = cur_pgc->program_map[pgn - 1] - 2;
-    auto cur_frames = 0u;
-
-    for (auto cur_cell = start_cell; cur_cell <= end_cell; cur_cell++)
+    file.open(path);
+    if (!file)
     {
-      auto dt = &cur_pgc->cell_playback[cur_cell].playback_time;
-      auto hour = from_bcd(dt->hour);
-      auto minute = from_bcd(dt->minute);
-      auto second = from_bcd(dt->second);
-      fps = ((dt->frame_u & 0xc0) >> 6) == 1 ? 25 : 30; // by definition
-      cur_frames += ((hour * 60 * 60) + minute * 60 + second) * fps;
-      cur_frames += ((dt->frame_u & 0x30) >> 4) * 10 + (dt->frame_u & 0x0f);
+      throw disc_exception(std::format("Could not open disc list {}", path));
     }
+  }
+  auto &in = file.is_open() ? static_cast<std::istream &>(file) : std::cin;
 
-    overall_frames += cur_frames;
-    writer.on_chapter_start(frames_to_timestamp_ms(overall_frames, fps));
+  auto discs = std::vector<std::string>{};
+  for (std::string line; std::getline(in, line);)
+  {
+    if (!line.empty())
+    {
+      discs.push_back(std::move(line));
+    }
   }
+  return discs;
+}
 
-  writer.on_title_end();
+unsigned shard_of(std::string_view path, unsigned num_shards)
+{
+  return static_cast<unsigned>(fnv1a(path) % num_shards);
 }
-} // namespace
 
-int main(int argc, char **argv)
+std::string shard_output_path(char const *output, shard_spec const &shard)
 {
-  if (!(argc == 2 || argc == 3))
-  {
-    std::cerr << "Usage : " << argv[0]
-              << " path_to_VIDEO_TS [title_no]\n"
-                 "If title_no is not specified or 0, chapters from all titles "
-                 "are output\n";
+  return std::format("{}.{}-of-{}", output, shard.index, shard.count);
+}
 
-    return 1;
+// Unbuffered sink for batch records which keeps track of how much has been
+// written, so that the journal can refer to output offsets.
+struct batch_output
+{
+  batch_output(unique_fd fd, uint64_t offset) : fd_(std::move(fd)), offset_(offset)
+  {
   }
 
-  auto title = unsigned{};
-  if (argc == 3)
+  void write(std::string_view data)
   {
-    try
+    while (!data.empty())
     {
-      auto title_parsed = std::stoi(argv[2]);
-      if (title_parsed < 0)
+      auto const ret = ::write(fd_.get(), data.data(), data.size());
+      if (ret < 0)
       {
-        std::cerr << "Title cannot be a negative integer.\n";
-        return 1;
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw stream_exception(std::format("Failed writing output : {}", std::strerror(errno)));
       }
-      title = static_cast<unsigned>(title_parsed);
+      data.remove_prefix(static_cast<size_t>(ret));
+      offset_ += static_cast<uint64_t>(ret);
     }
-    catch (...)
+  }
+
+  void sync()
+  {
+    if (::fdatasync(fd_.get()) != 0 && errno != EINVAL)
     {
-      std::cerr << "Could not convert " << argv[2] << " to integer\n";
-      return 1;
+      throw stream_exception(std::format("Failed syncing output : {}", std::strerror(errno)));
     }
   }
 
-  auto logger = libdvdread_logger{};
-  try
+  uint64_t offset() const
   {
-    auto dvd = dvd_open(argv[1], logger);
-    auto vmg = ifo_open(*dvd, 0);
+    return offset_;
+  }
+
+private:
+  unique_fd fd_;
+  uint64_t offset_;
+};
 
-    if (title == 0u)
+// Opens the batch output, writing to stdout if path is empty. When resuming,
+// everything past resume_offset is the remainder of a record the journal does
+// not know about, and is cut off.
+batch_output open_batch_output(std::string const &path, std::optional<uint64_t> resume_offset)
+{
+  if (path.empty())
+  {
+    return batch_output{unique_fd{::dup(STDOUT_FILENO)}, 0};
+  }
+  auto fd = open_file(path.c_str(), O_WRONLY | O_CREAT | (resume_offset ? 0 : O_TRUNC));
+  if (resume_offset)
+  {
+    struct stat st;
+    if (::fstat(fd.get(), &st) != 0 || static_cast<uint64_t>(st.st_size) < *resume_offset)
     {
-      auto writer = matroska_chapter_xml_writer{std::cout};
-      for (auto t = 0u; t < vmg->tt_srpt->nr_of_srpts; ++t)
-      {
-        get_chapters_for_title(*dvd, *vmg, t, writer);
-      }
+      throw disc_exception(std::format("{} is shorter than the journal says, cannot resume", path));
     }
-    else
+    if (::ftruncate(fd.get(), static_cast<off_t>(*resume_offset)) != 0 ||
+        ::lseek(fd.get(), static_cast<off_t>(*resume_offset), SEEK_SET) < 0)
     {
-      auto const num_titles = vmg->tt_srpt->nr_of_srpts;
-      if (title > num_titles)
-      {
-        std::cerr << std::format("Title {} requested, but DVD has {} titles.\n", title, num_titles);
-        return 1;
-      }
-      auto writer = matroska_chapter_xml_writer{std::cout};
-      get_chapters_for_title(*dvd, *vmg, title - 1, writer);
+      throw stream_exception(std::format("Failed to truncate {} : {}", path, std::strerror(errno)));
     }
   }
-  catch (libdvdread_exception const &ex)
+  return batch_output{std::move(fd), resume_offset.value_or(0)};
+}
+
+// Write-ahead journal of a batch run. Each completed disc is recorded as a
+// "<output offset> <path>" line, the offset being where the output ends after
+// its record. Entries are buffered and committed in groups : the output is
+// synced first, then the entries are appended and the journal is synced, so a
+// committed entry never refers to output that could still be lost. A torn
+// last line left by a crash is ignored and cut off when reopening.
+struct batch_journal
+{
+  batch_journal(char const *path, unsigned sync_every)
+      : fd_(open_file(path, O_RDWR | O_CREAT)), path_(path), sync_every_(sync_every)
   {
-    std::cerr << "DVD read error : " << ex.what() << '\n';
-    return 1;
+    load();
   }
-  catch (std::exception const &ex)
+
+  bool completed(std::string const &disc) const
   {
-    std::cerr << "Fatal error : " << ex.what() << '\n';
-    return 1;
+    return completed_.contains(disc);
   }
-  catch (...)
+
+  std::optional<uint64_t> committed_offset() const
   {
-    std::cerr << "Unknown error\n";
-    return 1;
+    return committed_offset_;
   }
 
-  logger.disable_report();
-}
+  void record(std::string_view disc, batch_output &out)
+  {
+    pending_ += std::format("{} {}\n", out.offset(), disc);
+    if (++num_pending_ >= sync_every_ || std::chrono::steady_clock::now() - last_commit_ >= commit_interval)
+    {
+      commit(out);
+    }
+  }
+
+  void commit(batch_output &out)
+  {
+    if (num_pending_ == 0)
+    {
+      return;
+    }
+    out.sync();
+    for (auto data = std::string_view{pending_}; !data.empty();)
+    {
+      auto const ret = ::write(fd_.get(), data.data(), data.size());
+      if (ret < 0 && errno != EINTR)
+      {
+        throw stream_exception(std::format("Failed writing journal {} : {}", path_, std::strerror(errno)));
+      }
+      data.remove_prefix(ret < 0 ? 0 : static_cast<size_t>(ret));
+    }
+    if (::fdatasync(fd_.get()) != 0)
+    {
+      throw stream_exception(std::format("Failed syncing journal {} : {}", path_, std::strerror(errno)));
+    }
+    pending_.clear();
+    num_pending_ = 0;
+    last_commit_ = std::chrono::steady_clock::now();
+  }
+
+private:
+  static constexpr auto commit_interval = std::chrono::seconds{1};
+
+  void load()
+  {
+    auto contents = std::string{};
+    char buf[64 * 1024];
+    for (ssize_t ret; (ret = ::read(fd_.get(), buf, sizeof(buf))) != 0;)
+    {
+      if (ret < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw stream_exception(std::format("Failed reading journal {} : {}", path_, std::strerror(errno)));
+      }
+      contents.append(buf, static_cast<size_t>(ret));
+    }
+
+    auto valid_size = size_t{0};
+    for (size_t eol; (eol = contents.find('\n', valid_size)) != std::string::npos; valid_size = eol + 1)
+    {
+      auto const line = std::string_view{contents}.substr(valid_size, eol - valid_size);
+      auto const space = line.find(' ');
+      auto offset = uint64_t{};
+      auto const [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), offset);
+      if (space == std::string_view::npos || ec != std::errc{} || ptr != line.data() + space)
+      {
+        throw disc_exception(std::format("Journal {} is corrupt at byte {}", path_, valid_size));
+      }
+      committed_offset_ = offset;
+      completed_.emplace(line.substr(space + 1));
+    }
+
+    if (::ftruncate(fd_.get(), static_cast<off_t>(valid_size)) != 0 ||
+        ::lseek(fd_.get(), static_cast<off_t>(valid_size), SEEK_SET) < 0)
+    {
+      throw stream_exception(std::format("Failed to truncate journal {} : {}", path_, std::strerror(errno)));
+    }
+  }
+
+  unique_fd fd_;
+  std::string path_;
+  unsigned sync_every_;
+  std::unordered_set<std::string> completed_;
+  std::optional<uint64_t> committed_offset_;
+  std::string pending_;
+  unsigned num_pending_ = 0;
+  std::chrono::steady_clock::time_point last_commit_ = std::chrono::steady_clock::now();
+};
+
+struct disc_job
+{
+  size_t seq; // position in output order
+  std::string path;
+  dev_t device;
+  uint64_t size;
+  uint64_t cost_us;
+  unsigned attempt = 0;
+};
+
+struct disc_timing
+{
+  std::string path;
+  dev_t device;
+  uint64_t size;
+  uint64_t elapsed_us;
+  bool ok;
+  perf_phases counters = {};
+  uint64_t arena_bytes = 0;
+};
+
+// Per-disc timings of earlier runs, as written to the stats file. Discs seen
+// before are expected to cost what they did last time, others what discs on
+// the same mount cost on average, or a guess based on their size.
+struct disc_cost_model
+{
+  void load(char const *path)
+  {
+    auto in = std::ifstream{path};
+    for (std::string line; std::getline(in, line);)
+    {
+      if (auto const timing = parse_timing(line))
+      {
+        past_[timing->path] = timing->elapsed_us;
+        auto &dev = per_device_[timing->device];
+        dev.first += timing->elapsed_us;
+        ++dev.second;
+      }
+    }
+  }
+
+  uint64_t estimate(std::string const &path, dev_t device, uint64_t size) const
+  {
+    if (auto const it = past_.find(path); it != past_.end())
+    {
+      return it->second;
+    }
+    if (auto const it = per_device_.find(device); it != per_device_.end())
+    {
+      return it->second.first / it->second.second;
+    }
+    return default_cost_us + size / bytes_per_cost_us;
+  }
+
+  static std::string format_timing(disc_timing const &timing)
+  {
+    return std::format("{}\t{}\t{}\t{}\t{}\n", timing.elapsed_us, timing.ok ? "ok" : "failed", timing.device,
+                       timing.size, timing.path);
+  }
+
+  // Per-phase counts go on lines of their own, which parse_timing() skips :
+  // "perf", the phase, the counts ("-" if unavailable) and the path.
+  static std::string format_counters(disc_timing const &timing)
+  {
+    auto str = std::string{};
+    for (auto p = size_t{0}; p < num_perf_phases; ++p)
+    {
+      auto const &values = timing.counters[p];
+      if (std::none_of(values.begin(), values.end(), [](auto &&v) { return v.has_value(); }))
+      {
+        continue;
+      }
+      str += std::format("perf\t{}", perf_phase_names[p]);
+      for (auto const &v : values)
+      {
+        str += v ? std::format("\t{}", *v) : std::string{"\t-"};
+      }
+      str += std::format("\t{}\n", timing.path);
+    }
+    return str;
+  }
+
+  static std::optional<disc_timing> parse_timing(std::string_view line)
+  {
+    auto fields = std::array<std::string_view, 5>{};
+    for (auto i = size_t{0}; i < fields.size() - 1; ++i)
+    {
+      auto const tab = line.find('\t');
+      if (tab == std::string_view::npos)
+      {
+        return std::nullopt;
+      }
+      fields[i] = line.substr(0, tab);
+      line.remove_prefix(tab + 1);
+    }
+    fields.back() = line;
+
+    auto timing = disc_timing{std::string{fields[4]}, 0, 0, 0, fields[1] == "ok"};
+    auto parse = [](std::string_view str, auto &value) {
+      auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+      return ec == std::errc{} && ptr == str.data() + str.size();
+    };
+    if (!parse(fields[0], timing.elapsed_us) || !parse(fields[2], timing.device) || !parse(fields[3], timing.size))
+    {
+      return std::nullopt;
+    }
+    return timing;
+  }
+
+private:
+  static constexpr uint64_t default_cost_us = 5000;
+  static constexpr uint64_t bytes_per_cost_us = 1024 * 1024;
+
+  std::unordered_map<std::string, uint64_t> past_;
+  std::unordered_map<dev_t, std::pair<uint64_t, uint64_t>> per_device_;
+};
+
+// Hands out discs to batch workers. Jobs are dealt round-robin in order of
+// decreasing expected cost, so every worker starts with its most expensive
+// discs and the cheap ones are left to fill the gaps at the end. A worker out
+// of runnable jobs steals from the back of the other queues. At most io_limit
+// discs on the same device (mount) are processed at once, so a slow NFS
+// mount cannot occupy every worker while local discs wait. While the output
+// side applies backpressure, nothing but the disc the output is waiting for
+// is started, which is what lets the output drain.
+struct batch_scheduler
+{
+  batch_scheduler(std::vector<disc_job> jobs, unsigned num_workers, unsigned io_limit)
+      : queues_(num_workers), io_limit_(io_limit), num_left_(jobs.size())
+  {
+    std::stable_sort(jobs.begin(), jobs.end(), [](auto &&a, auto &&b) { return a.cost_us > b.cost_us; });
+    for (auto i = size_t{0}; i < jobs.size(); ++i)
+    {
+      queues_[i % num_workers].push_back(std::move(jobs[i]));
+    }
+  }
+
+  // The paths of the jobs in the order they are expected to start in : the
+  // first job of every queue, then the second, and so on.
+  std::vector<std::string> start_order()
+  {
+    auto const lock = std::lock_guard{mutex_};
+    auto paths = std::vector<std::string>{};
+    for (auto i = size_t{0}; paths.size() < num_left_; ++i)
+    {
+      for (auto const &queue : queues_)
+      {
+        if (i < queue.size())
+        {
+          paths.push_back(queue[i].path);
+        }
+      }
+    }
+    return paths;
+  }
+
+  // Blocks until a job may be started by the given worker, returns nullopt
+  // once all jobs have been handed out or the batch is cancelled.
+  std::optional<disc_job> next(unsigned worker)
+  {
+    auto lock = std::unique_lock{mutex_};
+    for (;;)
+    {
+      if (num_left_ == 0 || cancelled_)
+      {
+        return std::nullopt;
+      }
+      if (auto job = take(queues_[worker], false))
+      {
+        return job;
+      }
+      for (auto i = 1u; i < queues_.size(); ++i)
+      {
+        if (auto job = take(queues_[(worker + i) % queues_.size()], true))
+        {
+          return job;
+        }
+      }
+      cv_.wait(lock);
+    }
+  }
+
+  void finish(disc_job const &job)
+  {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      --busy_devices_[job.device];
+    }
+    cv_.notify_all();
+  }
+
+  // Puts a job back at the end of the shortest queue, to be tried again once
+  // the rest of the work has had its turn.
+  void retry(disc_job job)
+  {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      ++job.attempt;
+      std::min_element(queues_.begin(), queues_.end(), [](auto &&a, auto &&b) {
+        return a.size() < b.size();
+      })->push_back(std::move(job));
+      ++num_left_;
+    }
+    cv_.notify_all();
+  }
+
+  void cancel()
+  {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      cancelled_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  // Holds back every job but the one with sequence number waiting_for, or
+  // lifts that restriction if waiting_for is nullopt.
+  void set_backpressure(std::optional<size_t> waiting_for)
+  {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      waiting_for_ = waiting_for;
+    }
+    cv_.notify_all();
+  }
+
+private:
+  std::optional<disc_job> take(std::deque<disc_job> &queue, bool from_back)
+  {
+    auto const runnable = [this](auto &&job) {
+      return busy_devices_[job.device] < io_limit_ && (!waiting_for_ || job.seq == *waiting_for_);
+    };
+    auto take_at = [&](auto it) {
+      auto job = std::move(*it);
+      queue.erase(it);
+      ++busy_devices_[job.device];
+      --num_left_;
+      return job;
+    };
+    if (from_back)
+    {
+      if (auto const it = std::find_if(queue.rbegin(), queue.rend(), runnable); it != queue.rend())
+      {
+        return take_at(std::next(it).base());
+      }
+    }
+    else if (auto const it = std::find_if(queue.begin(), queue.end(), runnable); it != queue.end())
+    {
+      return take_at(it);
+    }
+    return std::nullopt;
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::deque<disc_job>> queues_;
+  std::unordered_map<dev_t, unsigned> busy_devices_;
+  unsigned io_limit_;
+  size_t num_left_;
+  bool cancelled_ = false;
+  std::optional<size_t> waiting_for_;
+};
+
+// Gets the IFOs of the discs about to be started read (--readahead), staying
+// depth discs ahead of the ones handed out to the workers. Finding the IFOs of
+// an image takes a few synchronous reads of its UDF file system, so this runs
+// on a thread of its own. Like the helper threads of --timeout, that thread is
+// left behind rather than waited for, as a disc on a dead mount would hold up
+// the end of the batch.
+struct readahead_planner
+{
+  readahead_planner(std::vector<std::string> paths, unsigned depth) : state_(std::make_shared<state>())
+  {
+    state_->paths = std::move(paths);
+    state_->depth = depth;
+    std::thread{&run, state_}.detach();
+  }
+
+  ~readahead_planner()
+  {
+    {
+      auto const lock = std::lock_guard{state_->mutex};
+      state_->stopped = true;
+    }
+    state_->cv.notify_one();
+  }
+
+  // Called whenever a disc is handed out.
+  void advance()
+  {
+    {
+      auto const lock = std::lock_guard{state_->mutex};
+      ++state_->started;
+    }
+    state_->cv.notify_one();
+  }
+
+private:
+  struct state
+  {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> paths;
+    unsigned depth = 0;
+    size_t started = 0;
+    bool stopped = false;
+  };
+
+  static void run(std::shared_ptr<state> state)
+  {
+    for (auto next = size_t{0}; next < state->paths.size(); ++next)
+    {
+      {
+        auto lock = std::unique_lock{state->mutex};
+        state->cv.wait(lock, [&] { return state->stopped || next < state->started + state->depth; });
+        if (state->stopped)
+        {
+          return;
+        }
+        if (next < state->started)
+        {
+          // Already opened by its worker, which got its IFOs going itself.
+          continue;
+        }
+      }
+      prefetch_ifos(state->paths[next].c_str());
+    }
+  }
+
+  std::shared_ptr<state> state_;
+};
+
+// Reorder stage between the workers and the output. Finished records are
+// written in disc list order, and journaled as they are written; records that
+// complete early are buffered. Once the buffer holds more than max_buffered
+// bytes, the scheduler is told to only start the disc the output is waiting
+// for. In unordered mode records are written as soon as they complete, their
+// header line identifying the disc.
+struct ordered_sink
+{
+  ordered_sink(batch_output &out, batch_journal *journal, batch_scheduler &scheduler, size_t max_buffered,
+               bool unordered)
+      : out_(out), journal_(journal), scheduler_(scheduler), max_buffered_(max_buffered), unordered_(unordered)
+  {
+  }
+
+  // A failed disc is submitted without a record, so that the ones after it
+  // do not wait for it forever.
+  void submit(size_t seq, std::string const &disc, std::optional<std::string> record)
+  {
+    auto const lock = std::lock_guard{mutex_};
+    if (unordered_)
+    {
+      write(disc, record);
+      return;
+    }
+
+    buffered_bytes_ += record ? record->size() : 0;
+    pending_.emplace(seq, std::make_pair(disc, std::move(record)));
+    high_water_bytes_ = std::max(high_water_bytes_, buffered_bytes_);
+    high_water_records_ = std::max(high_water_records_, pending_.size());
+    for (auto it = pending_.begin(); it != pending_.end() && it->first == next_seq_; it = pending_.erase(it))
+    {
+      auto const &[path, rec] = it->second;
+      write(path, rec);
+      buffered_bytes_ -= rec ? rec->size() : 0;
+      ++next_seq_;
+    }
+
+    auto const over_limit = buffered_bytes_ > max_buffered_;
+    if (over_limit || backpressure_)
+    {
+      backpressure_ = over_limit;
+      scheduler_.set_backpressure(over_limit ? std::optional{next_seq_} : std::nullopt);
+    }
+  }
+
+  size_t high_water_bytes() const
+  {
+    return high_water_bytes_;
+  }
+
+  size_t high_water_records() const
+  {
+    return high_water_records_;
+  }
+
+  // Counted around writing and journaling records, whichever thread did it.
+  perf_values const &write_counters() const
+  {
+    return write_counters_;
+  }
+
+private:
+  void write(std::string const &disc, std::optional<std::string> const &record)
+  {
+    if (record)
+    {
+      auto const span = trace_span{"write"};
+      auto const perf = perf_profiler::instance().enabled();
+      auto const before = perf ? perf_profiler::instance().read_thread() : perf_values{};
+      out_.write(*record);
+      if (journal_)
+      {
+        journal_->record(disc, out_);
+      }
+      if (perf)
+      {
+        add_counts(write_counters_, diff_counts(perf_profiler::instance().read_thread(), before));
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  batch_output &out_;
+  batch_journal *journal_;
+  batch_scheduler &scheduler_;
+  size_t max_buffered_;
+  bool unordered_;
+  std::map<size_t, std::pair<std::string, std::optional<std::string>>> pending_;
+  size_t next_seq_ = 0;
+  size_t buffered_bytes_ = 0;
+  size_t high_water_bytes_ = 0;
+  size_t high_water_records_ = 0;
+  bool backpressure_ = false;
+  perf_values write_counters_ = {};
+};
+
+void report_perf_counters(std::vector<disc_timing> const &timings, perf_values const &write_counters)
+{
+  auto totals = perf_phases{};
+  for (auto const &timing : timings)
+  {
+    for (auto p = size_t{0}; p < num_perf_phases; ++p)
+    {
+      add_counts(totals[p], timing.counters[p]);
+    }
+  }
+  add_counts(totals[perf_write], write_counters);
+
+  auto const count = [](std::optional<uint64_t> v) { return v ? std::format("{}", *v) : std::string{"n/a"}; };
+  auto const row = [&](std::string_view name, perf_values const &v) {
+    auto const ipc = v[perf_cycles] && v[perf_instructions] && *v[perf_cycles]
+                         ? std::format("{:.2f}", double(*v[perf_instructions]) / *v[perf_cycles])
+                         : std::string{"n/a"};
+    std::cerr << std::format("{:<8}{:>16}{:>16}{:>6}{:>14}{:>14}{:>14}\n", name, count(v[perf_cycles]),
+                             count(v[perf_instructions]), ipc, count(v[perf_cache_misses]),
+                             count(v[perf_context_switches]), count(v[perf_page_faults]));
+  };
+  std::cerr << std::format("{:<8}{:>16}{:>16}{:>6}{:>14}{:>14}{:>14}\n", "Phase", "cycles", "instructions", "IPC",
+                           "cache misses", "ctx switches", "page faults");
+  auto batch = perf_values{};
+  for (auto p = size_t{0}; p < num_perf_phases; ++p)
+  {
+    row(perf_phase_names[p], totals[p]);
+    add_counts(batch, totals[p]);
+  }
+  row("total", batch);
+}
+
+// Working memory of one disc in batch mode. What is allocated on behalf of the
+// disc (libdvdread messages, IFO derived vectors, chapter lists, the writers'
+// strings and the disc's output record) is bump allocated, from a buffer the
+// worker thread reuses for every disc before falling back to the heap, and all
+// of it is dropped at once when the disc is done. Workers thus rarely contend
+// on the allocator for these. libdvdread's own IFO structures are still
+// allocated by libdvdread, on the heap.
+struct disc_arena : public std::pmr::memory_resource
+{
+  static constexpr size_t initial_size = 256 * 1024;
+
+  disc_arena() : arena_(thread_buffer().data(), thread_buffer().size())
+  {
+  }
+
+  // Bytes handed out so far, which with nothing ever freed is also the
+  // high-water mark.
+  uint64_t used() const
+  {
+    return used_;
+  }
+
+private:
+  static std::vector<std::byte> &thread_buffer()
+  {
+    thread_local auto buffer = std::vector<std::byte>(initial_size);
+    return buffer;
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    used_ += bytes;
+    return arena_.allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override
+  {
+    arena_.deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+  std::pmr::monotonic_buffer_resource arena_;
+  uint64_t used_ = 0;
+};
+
+void report_batch_stats(std::vector<disc_timing> timings, std::chrono::steady_clock::duration wall_time,
+                        ordered_sink const &sink)
+{
+  auto const num_failed = std::count_if(timings.begin(), timings.end(), [](auto &&t) { return !t.ok; });
+  std::cerr << std::format("Processed {} discs ({} failed) in {:.3f} s\n", timings.size(), num_failed,
+                           std::chrono::duration<double>(wall_time).count());
+  std::cerr << std::format("Reorder buffer high-water mark : {} records, {} bytes\n", sink.high_water_records(),
+                           sink.high_water_bytes());
+  if (perf_profiler::instance().enabled())
+  {
+    report_perf_counters(timings, sink.write_counters());
+  }
+  if (timings.empty())
+  {
+    return;
+  }
+
+  auto arena = std::vector<uint64_t>{};
+  for (auto const &timing : timings)
+  {
+    arena.push_back(timing.arena_bytes);
+  }
+  std::sort(arena.begin(), arena.end());
+  auto const outgrown = arena.end() - std::upper_bound(arena.begin(), arena.end(), disc_arena::initial_size);
+  std::cerr << std::format("Per-disc arena high-water mark : p50 {} bytes, max {} bytes, {} discs outgrew the {} KiB "
+                           "thread buffer\n",
+                           arena[(arena.size() - 1) / 2], arena.back(), outgrown, disc_arena::initial_size / 1024);
+
+  std::sort(timings.begin(), timings.end(), [](auto &&a, auto &&b) { return a.elapsed_us < b.elapsed_us; });
+  auto const percentile = [&](unsigned p) { return timings[(timings.size() - 1) * p / 100].elapsed_us / 1000.0; };
+  std::cerr << std::format("Per disc : p50 {:.1f} ms, p90 {:.1f} ms, p99 {:.1f} ms, max {:.1f} ms ({})\n",
+                           percentile(50), percentile(90), percentile(99), timings.back().elapsed_us / 1000.0,
+                           timings.back().path);
+}
+
+enum class disc_status : uint8_t
+{
+  ok,
+  failed,
+  timed_out,
+  crashed,
+};
+
+struct disc_result
+{
+  disc_status status;
+  std::string record; // header line included, empty unless status is ok
+  perf_phases counters = {};
+  uint64_t arena_bytes = 0;
+};
+
+disc_result run_disc(options const &opts, std::string const &path, dedup_index *index = nullptr)
+{
+  trace_recorder::instance().set_disc(path);
+  auto const span = trace_span{"disc"};
+  auto &profiler = perf_profiler::instance();
+  profiler.begin_disc();
+  auto arena = disc_arena{};
+  auto logger = libdvdread_logger{&arena};
+  auto record = pmr_ostringstream{std::ios::out, &arena};
+  record << record_header(path);
+  auto timed_out = false;
+  auto const ok = report_errors(std::format("{} : ", path), [&] {
+    try
+    {
+      process_disc(opts, path.c_str(), logger, record, &arena, index);
+    }
+    catch (timeout_exception const &)
+    {
+      timed_out = true;
+      throw;
+    }
+  });
+  auto const counters = profiler.end_disc();
+  if (ok)
+  {
+    logger.disable_report();
+    // The one copy of the record out of the arena, which goes with this call.
+    return {disc_status::ok, std::string{record.view()}, counters, arena.used()};
+  }
+  return {timed_out ? disc_status::timed_out : disc_status::failed, {}, counters, arena.used()};
+}
+
+// File descriptors a pool worker process finds its control socket and result
+// buffer at.
+constexpr int pool_socket_fd = 3;
+constexpr int pool_buffer_fd = 4;
+constexpr size_t pool_buffer_size = 4 * 1024 * 1024;
+
+// Sent by a pool worker for every piece of a record put into the shared
+// buffer. The parent acknowledges each piece but the last one, upon which the
+// worker overwrites the buffer with the next piece. The last piece also
+// carries the --perf counts and the arena usage of the disc.
+struct pool_chunk
+{
+  uint32_t size;
+  disc_status status;
+  bool last;
+  perf_phases counters;
+  uint64_t arena_bytes;
+};
+
+struct shared_buffer
+{
+  shared_buffer(unique_fd fd, size_t size)
+      : fd_(std::move(fd)), size_(size), data_(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.get(), 0))
+  {
+    if (data_ == MAP_FAILED)
+    {
+      throw stream_exception(std::format("Failed to map shared buffer : {}", std::strerror(errno)));
+    }
+  }
+  shared_buffer(shared_buffer const &) = delete;
+  shared_buffer &operator=(shared_buffer const &) = delete;
+  ~shared_buffer()
+  {
+    ::munmap(data_, size_);
+  }
+
+  static shared_buffer create(size_t size)
+  {
+    auto fd = unique_fd{::memfd_create("ifo2mkv-results", MFD_CLOEXEC)};
+    if (fd.get() < 0 || ::ftruncate(fd.get(), static_cast<off_t>(size)) != 0)
+    {
+      throw stream_exception(std::format("Failed to create shared buffer : {}", std::strerror(errno)));
+    }
+    return shared_buffer{std::move(fd), size};
+  }
+
+  int fd() const
+  {
+    return fd_.get();
+  }
+  size_t size() const
+  {
+    return size_;
+  }
+  uint8_t *data() const
+  {
+    return static_cast<uint8_t *>(data_);
+  }
+
+private:
+  unique_fd fd_;
+  size_t size_;
+  void *data_;
+};
+
+// Body of a pool worker process : takes disc paths from the control socket and
+// hands the records back through the shared buffer, for as long as the parent
+// keeps the socket open.
+int run_pool_worker(options const &opts)
+{
+  trace_recorder::instance().set_thread_name(std::format("pool worker {}", ::getpid()));
+  auto const buffer = shared_buffer{unique_fd{pool_buffer_fd}, pool_buffer_size};
+  auto path = std::vector<char>(64 * 1024);
+  for (;;)
+  {
+    auto const path_size = ::recv(pool_socket_fd, path.data(), path.size(), 0);
+    if (path_size <= 0)
+    {
+      trace_recorder::instance().finish(false);
+      return path_size == 0 ? 0 : 1;
+    }
+
+    auto const result = run_disc(opts, std::string{path.data(), static_cast<size_t>(path_size)});
+    auto remaining = std::string_view{result.record};
+    for (;;)
+    {
+      auto const size = std::min(remaining.size(), buffer.size());
+      std::memcpy(buffer.data(), remaining.data(), size);
+      remaining.remove_prefix(size);
+      auto const chunk = pool_chunk{static_cast<uint32_t>(size), result.status, remaining.empty(), result.counters,
+                                    result.arena_bytes};
+      if (::send(pool_socket_fd, &chunk, sizeof(chunk), MSG_NOSIGNAL) != sizeof(chunk))
+      {
+        return 1;
+      }
+      if (chunk.last)
+      {
+        break;
+      }
+      char ack;
+      if (::recv(pool_socket_fd, &ack, sizeof(ack), 0) != sizeof(ack))
+      {
+        return 1;
+      }
+    }
+  }
+}
+
+// Parent side of one worker process of the --isolate pool. The process is
+// this very binary, re-executed with the same options plus --pool-worker, so
+// that respawning from a multi-threaded parent is safe. It serves disc after
+// disc; if it crashes or overruns the timeout it is replaced by a fresh one
+// and the disc at hand is reported as the culprit.
+struct pool_process
+{
+  pool_process(char **argv) : buffer_(shared_buffer::create(pool_buffer_size))
+  {
+    for (auto arg = argv; *arg; ++arg)
+    {
+      args_.emplace_back(*arg);
+    }
+    args_.emplace_back("--pool-worker");
+    spawn();
+  }
+  pool_process(pool_process const &) = delete;
+  pool_process &operator=(pool_process const &) = delete;
+  ~pool_process()
+  {
+    socket_ = unique_fd{-1};
+    reap();
+  }
+
+  disc_result process(std::string const &path, std::optional<std::chrono::seconds> timeout)
+  {
+    auto const deadline = timeout ? std::optional{deadline_clock::now() + *timeout + timeout_grace} : std::nullopt;
+    if (::send(socket_.get(), path.data(), path.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(path.size()))
+    {
+      return respawn(path);
+    }
+
+    auto record = std::string{};
+    for (;;)
+    {
+      auto wait_ms = -1;
+      if (deadline)
+      {
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(*deadline - deadline_clock::now());
+        wait_ms = static_cast<int>(std::max<int64_t>(0, left.count()));
+      }
+      auto pfd = ::pollfd{socket_.get(), POLLIN, 0};
+      auto const ret = ::poll(&pfd, 1, wait_ms);
+      if (ret < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (ret == 0)
+      {
+        std::cerr << std::format("{} : Input error : Timed out after {} s, killed worker process\n", path,
+                                 timeout->count());
+        ::kill(pid_, SIGKILL);
+        restart();
+        return {disc_status::timed_out, {}};
+      }
+
+      auto chunk = pool_chunk{};
+      if (::recv(socket_.get(), &chunk, sizeof(chunk), 0) != sizeof(chunk) || chunk.size > buffer_.size())
+      {
+        return respawn(path);
+      }
+      record.append(reinterpret_cast<char const *>(buffer_.data()), chunk.size);
+      if (chunk.last)
+      {
+        return {chunk.status, std::move(record), chunk.counters, chunk.arena_bytes};
+      }
+      auto const ack = char{};
+      if (::send(socket_.get(), &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack))
+      {
+        return respawn(path);
+      }
+    }
+  }
+
+private:
+  static constexpr auto timeout_grace = std::chrono::seconds{1};
+
+  void spawn()
+  {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+      throw stream_exception(std::format("Failed to create socket pair : {}", std::strerror(errno)));
+    }
+    auto parent_end = unique_fd{sv[0]};
+    auto child_end = unique_fd{sv[1]};
+
+    auto argv = std::vector<char *>{};
+    for (auto &arg : args_)
+    {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_ = ::fork();
+    if (pid_ < 0)
+    {
+      throw stream_exception(std::format("Failed to fork worker process : {}", std::strerror(errno)));
+    }
+    if (pid_ == 0)
+    {
+      // Only async-signal-safe calls until exec. Both descriptors are moved
+      // out of the way first, as either could sit at the other's target.
+      auto const sock = ::fcntl(child_end.get(), F_DUPFD_CLOEXEC, 10);
+      auto const buf = ::fcntl(buffer_.fd(), F_DUPFD_CLOEXEC, 10);
+      if (sock < 0 || buf < 0 || ::dup2(sock, pool_socket_fd) < 0 || ::dup2(buf, pool_buffer_fd) < 0)
+      {
+        ::_exit(127);
+      }
+      ::execv("/proc/self/exe", argv.data());
+      ::_exit(127);
+    }
+    socket_ = std::move(parent_end);
+  }
+
+  // Waits for the worker process to go away, returning a description of how
+  // it ended.
+  std::string reap()
+  {
+    int status;
+    while (::waitpid(pid_, &status, 0) < 0)
+    {
+      if (errno != EINTR)
+      {
+        return "vanished";
+      }
+    }
+    if (WIFSIGNALED(status))
+    {
+      return std::format("was killed by signal {} ({})", WTERMSIG(status), ::strsignal(WTERMSIG(status)));
+    }
+    return std::format("exited with status {}", WEXITSTATUS(status));
+  }
+
+  std::string restart()
+  {
+    socket_ = unique_fd{-1};
+    auto const how = reap();
+    spawn();
+    return how;
+  }
+
+  disc_result respawn(std::string const &path)
+  {
+    std::cerr << std::format("{} : worker process {}, disc marked as failed\n", path, restart());
+    return {disc_status::crashed, {}};
+  }
+
+  std::vector<std::string> args_;
+  shared_buffer buffer_;
+  unique_fd socket_{-1};
+  pid_t pid_ = -1;
+};
+
+int run_batch(options const &opts)
+{
+  auto const batch_start = std::chrono::steady_clock::now();
+  auto const discs = read_disc_list(opts.batch_list);
+  auto const out_path = !opts.output ? std::string{}
+                        : opts.shard ? shard_output_path(opts.output, *opts.shard)
+                                     : std::string{opts.output};
+  auto journal = std::optional<batch_journal>{};
+  if (opts.journal)
+  {
+    journal.emplace(opts.journal, opts.journal_sync);
+  }
+  auto out = open_batch_output(out_path, journal ? journal->committed_offset() : std::nullopt);
+  auto index = std::optional<dedup_index>{};
+  if (opts.dedup_index)
+  {
+    index.emplace(opts.dedup_index, std::format("{} {} {} {} {} {}", static_cast<int>(opts.mode), opts.title,
+                                                opts.main_only, opts.skip_decoys, static_cast<int>(opts.times),
+                                                opts.fingerprint ? static_cast<int>(*opts.fingerprint) : -1));
+  }
+
+  auto cost_model = disc_cost_model{};
+  if (opts.stats)
+  {
+    cost_model.load(opts.stats);
+  }
+  auto jobs = std::vector<disc_job>{};
+  for (auto const &disc : discs)
+  {
+    if ((opts.shard && shard_of(disc, opts.shard->count) != opts.shard->index) ||
+        (journal && journal->completed(disc)))
+    {
+      continue;
+    }
+    struct stat st = {};
+    ::stat(disc.c_str(), &st);
+    auto const size = S_ISREG(st.st_mode) ? static_cast<uint64_t>(st.st_size) : 0;
+    jobs.push_back({jobs.size(), disc, st.st_dev, size, cost_model.estimate(disc, st.st_dev, size)});
+  }
+
+  auto const num_workers = std::max(1u, std::min(opts.jobs, static_cast<unsigned>(jobs.size())));
+  auto scheduler = batch_scheduler{std::move(jobs), num_workers, opts.io_limit ? opts.io_limit : num_workers};
+  auto sink =
+      ordered_sink{out, journal ? &*journal : nullptr, scheduler, opts.reorder_buffer_mib << 20, opts.unordered};
+  auto readahead = std::optional<readahead_planner>{};
+  if (opts.readahead > 0)
+  {
+    readahead.emplace(scheduler.start_order(), opts.readahead);
+  }
+  auto timings_mutex = std::mutex{};
+  auto timings = std::vector<disc_timing>{};
+  auto error_mutex = std::mutex{};
+  auto error = std::exception_ptr{};
+  auto fail = [&] {
+    auto const lock = std::lock_guard{error_mutex};
+    error = std::current_exception();
+    scheduler.cancel();
+  };
+
+  auto work = [&](unsigned worker) {
+    trace_recorder::instance().set_thread_name(std::format("worker {}", worker));
+    // Spawning a worker process fails when running out of processes or file
+    // descriptors, which ends the batch like any other error does.
+    auto process = std::unique_ptr<pool_process>{};
+    try
+    {
+      if (opts.isolate)
+      {
+        process = std::make_unique<pool_process>(opts.argv);
+      }
+    }
+    catch (...)
+    {
+      fail();
+      return;
+    }
+    while (auto const job = scheduler.next(worker))
+    {
+      if (readahead)
+      {
+        readahead->advance();
+      }
+      auto const start = std::chrono::steady_clock::now();
+      auto result = disc_result{disc_status::crashed, {}};
+      try
+      {
+        result = process ? process->process(job->path, opts.timeout)
+                         : run_disc(opts, job->path, index ? &*index : nullptr);
+      }
+      catch (...)
+      {
+        scheduler.finish(*job);
+        fail();
+        return;
+      }
+      auto const elapsed =
+          std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+      scheduler.finish(*job);
+      auto const ok = result.status == disc_status::ok;
+      if (result.status == disc_status::timed_out && job->attempt < opts.retries)
+      {
+        std::cerr << std::format("{} : will be retried later\n", job->path);
+        scheduler.retry(*job);
+        continue;
+      }
+
+      try
+      {
+        sink.submit(job->seq, job->path, ok ? std::optional{std::move(result.record)} : std::nullopt);
+      }
+      catch (...)
+      {
+        fail();
+      }
+      auto const lock = std::lock_guard{timings_mutex};
+      timings.push_back({job->path, job->device, job->size, static_cast<uint64_t>(elapsed.count()), ok, result.counters,
+                         result.arena_bytes});
+    }
+  };
+  auto workers = std::vector<std::jthread>{};
+  for (auto w = 0u; w < num_workers; ++w)
+  {
+    workers.emplace_back(work, w);
+  }
+  workers.clear();
+
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+  if (journal)
+  {
+    journal->commit(out);
+  }
+  if (index)
+  {
+    index->sync();
+    std::cerr << std::format("Reused the output of {} duplicate discs.\n", index->num_reused());
+  }
+
+  auto const num_failed = std::count_if(timings.begin(), timings.end(), [](auto &&t) { return !t.ok; });
+  if (opts.stats)
+  {
+    auto stats_file = std::ofstream{opts.stats, std::ios::app};
+    for (auto const &timing : timings)
+    {
+      stats_file << disc_cost_model::format_timing(timing) << disc_cost_model::format_counters(timing);
+    }
+    report_batch_stats(std::move(timings), std::chrono::steady_clock::now() - batch_start, sink);
+  }
+  if (num_failed > 0)
+  {
+    std::cerr << std::format("Failed to process {} discs.\n", num_failed);
+    return 1;
+  }
+  return 0;
+}
+
+// Merges the outputs of a sharded batch run back into disc list order. Every
+// shard holds its records in list order, so the shard a disc hashes to only
+// ever needs to be looked at for its next record, keeping just one line per
+// shard in memory. Discs without a record (failed ones) are skipped.
+int run_merge(options const &opts)
+{
+  auto const discs = read_disc_list(opts.merge_list);
+  auto const num_shards = static_cast<unsigned>(opts.merge_inputs.size());
+
+  struct shard_reader
+  {
+    std::ifstream in;
+    std::string line;
+    bool at_end = false;
+
+    void advance()
+    {
+      at_end = !std::getline(in, line);
+    }
+  };
+  auto shards = std::vector<shard_reader>(num_shards);
+  for (auto i = 0u; i < num_shards; ++i)
+  {
+    shards[i].in.open(opts.merge_inputs[i], std::ios::binary);
+    if (!shards[i].in)
+    {
+      throw disc_exception(std::format("Could not open shard output {}", opts.merge_inputs[i]));
+    }
+    shards[i].advance();
+  }
+
+  auto const out_file = open_output(opts.output ? opts.output : "");
+  auto &out = out_file ? static_cast<std::ostream &>(*out_file) : std::cout;
+  for (auto const &disc : discs)
+  {
+    auto &shard = shards[shard_of(disc, num_shards)];
+    if (shard.at_end || parse_record_header(shard.line) != disc)
+    {
+      continue;
+    }
+    do
+    {
+      out << shard.line << '\n';
+      shard.advance();
+    } while (!shard.at_end && !parse_record_header(shard.line));
+  }
+
+  for (auto i = 0u; i < num_shards; ++i)
+  {
+    if (!shards[i].at_end)
+    {
+      std::cerr << std::format("{} contains records not in the disc list or out of order.\n", opts.merge_inputs[i]);
+      return 1;
+    }
+  }
+  out.flush();
+  return out ? 0 : 1;
+}
+
+void print_usage(char const *argv0)
+{
+  std::cerr << "Usage : " << argv0
+            << " [options] path_to_VIDEO_TS [title_no]\n"
+               "        "
+            << argv0
+            << " [options] --batch LIST\n"
+               "        "
+            << argv0
+            << " --merge LIST [-o FILE] SHARD_OUTPUT...\n"
+               "If title_no is not specified or 0, chapters from all titles "
+               "are output\n"
+               "path_to_VIDEO_TS may also be an image file, including "
+               "seekable zstd compressed images (*.zst), an http(s) URL of an image, "
+               "or - to read an image from stdin\n"
+               "Options :\n"
+               "  -m, --main          only output chapters of the main feature\n"
+               "  -s, --skip-decoys   skip titles that look like copy protection decoys\n"
+               "  --summary[=FORMAT]  only output duration, chapter count and fps per title,\n"
+               "                      FORMAT is table (default) or ndjson\n"
+               "  --fingerprint[=KIND]\n"
+               "                      also output a fingerprint of the disc, KIND is crc64\n"
+               "                      (default, over the file sizes and IFOs) or md5 (the\n"
+               "                      disc ID of libdvdread)\n"
+               "  --nav-times         take chapter times from the NAV packs in the VOBs, which\n"
+               "                      is exact but reads two sectors per cell\n"
+               "  --vob FILE          also extract the VOB data of the title (given by number or\n"
+               "                      --main) to FILE in playback order, - for stdout; this is\n"
+               "                      MPEG-PS as on the disc, not Matroska, to be muxed along\n"
+               "                      with the chapters, e.g. by mkvmerge --chapters\n"
+               "  --streams           output the video attributes, audio and subpicture streams\n"
+               "                      and chapters of every title, as NDJSON\n"
+               "  --sectors           output the cells of every chapter with their sector and\n"
+               "                      byte ranges in the VOBs of the title set, as NDJSON\n"
+               "  -b, --batch LIST    process every disc listed in LIST (one path per line,\n"
+               "                      - for stdin), each preceded by a header line\n"
+               "  -o, --output FILE   write output to FILE instead of stdout\n"
+               "  --direct-io         read image files and block devices with O_DIRECT, so that\n"
+               "                      scanning does not evict other data from the page cache\n"
+               "  --shard I/N         only process the discs of shard I (0-based) out of N,\n"
+               "                      output goes to FILE.I-of-N\n"
+               "  --merge LIST        merge shard outputs, given in shard order, back into\n"
+               "                      the order of LIST\n"
+               "  --journal FILE      record completed discs in FILE, and skip the discs it\n"
+               "                      lists when restarting an interrupted batch\n"
+               "  --dedup-index FILE  index the discs and titles of the batch in FILE, report\n"
+               "                      copies of discs and titles already in it, and reuse the\n"
+               "                      output of discs indexed with the same options\n"
+               "  --journal-sync N    commit the journal every N discs (default 64)\n"
+               "  -j, --jobs N        process N discs in parallel\n"
+               "  --io-limit N        process at most N discs per mount at once\n"
+               "  --readahead N       get the IFOs of the next N discs read into the page cache\n"
+               "                      while the current ones are processed\n"
+               "  --stats FILE        append per-disc timings to FILE and print a summary,\n"
+               "                      timings already in FILE are used for scheduling\n"
+               "  --perf              with --stats, also count cycles, instructions, cache\n"
+               "                      misses, context switches and page faults of the open,\n"
+               "                      parse, compute and write phases\n"
+               "  --reorder-buffer N  buffer at most N MiB of records completed out of order\n"
+               "                      before holding back other discs (default 64)\n"
+               "  --unordered         write records as they complete instead of in list\n"
+               "                      order, such output cannot be merged\n"
+               "  --timeout SECONDS   give up on a disc after SECONDS\n"
+               "  --retries N         retry a timed out disc N times at the end of the\n"
+               "                      batch (default 1)\n"
+               "  --isolate           process discs in a pool of worker processes, so that a\n"
+               "                      crash only fails the disc at hand\n"
+               "  --trace FILE        write a Chrome trace event timeline to FILE\n";
+}
+
+std::optional<unsigned> parse_count(std::string_view str)
+{
+  auto value = unsigned{};
+  auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc{} || ptr != str.data() + str.size() || value == 0)
+  {
+    return std::nullopt;
+  }
+  return value;
+}
+
+std::optional<shard_spec> parse_shard(std::string_view str)
+{
+  auto const slash = str.find('/');
+  if (slash == std::string_view::npos)
+  {
+    return std::nullopt;
+  }
+  try
+  {
+    auto const index = std::stoi(std::string{str.substr(0, slash)});
+    auto const count = std::stoi(std::string{str.substr(slash + 1)});
+    if (index < 0 || count < 1 || index >= count)
+    {
+      return std::nullopt;
+    }
+    return shard_spec{static_cast<unsigned>(index), static_cast<unsigned>(count)};
+  }
+  catch (...)
+  {
+    return std::nullopt;
+  }
+}
+
+std::optional<options> parse_options(int argc, char **argv)
+{
+  static ::option const long_options[] = {
+      {"main", no_argument, nullptr, 'm'},
+      {"skip-decoys", no_argument, nullptr, 's'},
+      {"summary", optional_argument, nullptr, 'S'},
+      {"sectors", no_argument, nullptr, 'V'},
+      {"streams", no_argument, nullptr, 'A'},
+      {"vob", required_argument, nullptr, 'D'},
+      {"nav-times", no_argument, nullptr, 'N'},
+      {"fingerprint", optional_argument, nullptr, 'F'},
+      {"batch", required_argument, nullptr, 'b'},
+      {"output", required_argument, nullptr, 'o'},
+      {"direct-io", no_argument, nullptr, 'O'},
+      {"shard", required_argument, nullptr, 'H'},
+      {"merge", required_argument, nullptr, 'M'},
+      {"journal", required_argument, nullptr, 'J'},
+      {"journal-sync", required_argument, nullptr, 'Y'},
+      {"dedup-index", required_argument, nullptr, 'X'},
+      {"jobs", required_argument, nullptr, 'j'},
+      {"io-limit", required_argument, nullptr, 'L'},
+      {"readahead", required_argument, nullptr, 'Q'},
+      {"stats", required_argument, nullptr, 'T'},
+      {"perf", no_argument, nullptr, 'P'},
+      {"reorder-buffer", required_argument, nullptr, 'R'},
+      {"unordered", no_argument, nullptr, 'U'},
+      {"timeout", required_argument, nullptr, 't'},
+      {"retries", required_argument, nullptr, 'r'},
+      {"isolate", no_argument, nullptr, 'I'},
+      {"pool-worker", no_argument, nullptr, 'W'},
+      {"trace", required_argument, nullptr, 'E'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  auto opts = options{};
+  opts.argv = argv;
+  for (int c; (c = ::getopt_long(argc, argv, "msb:o:j:", long_options, nullptr)) != -1;)
+  {
+    switch (c)
+    {
+    case 'm':
+      opts.main_only = true;
+      break;
+    case 's':
+      opts.skip_decoys = true;
+      break;
+    case 'S':
+      if (!optarg || optarg == std::string_view{"table"})
+      {
+        opts.mode = output_mode::summary_table;
+      }
+      else if (optarg == std::string_view{"ndjson"})
+      {
+        opts.mode = output_mode::summary_ndjson;
+      }
+      else
+      {
+        std::cerr << "Unknown summary format " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'V':
+      opts.mode = output_mode::sectors;
+      break;
+    case 'A':
+      opts.mode = output_mode::streams;
+      break;
+    case 'D':
+      opts.vob = optarg;
+      break;
+    case 'N':
+      opts.times = chapter_times::nav_packs;
+      break;
+    case 'F':
+      if (!optarg || optarg == std::string_view{"crc64"})
+      {
+        opts.fingerprint = fingerprint_kind::crc64;
+      }
+      else if (optarg == std::string_view{"md5"})
+      {
+        opts.fingerprint = fingerprint_kind::disc_id;
+      }
+      else
+      {
+        std::cerr << "Unknown fingerprint kind " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'b':
+      opts.batch_list = optarg;
+      break;
+    case 'o':
+      opts.output = optarg;
+      break;
+    case 'O':
+      opts.direct_io = true;
+      break;
+    case 'H':
+      opts.shard = parse_shard(optarg);
+      if (!opts.shard)
+      {
+        std::cerr << "Invalid shard " << optarg << ", expected I/N with 0 <= I < N\n";
+        return std::nullopt;
+      }
+      break;
+    case 'M':
+      opts.merge_list = optarg;
+      break;
+    case 'J':
+      opts.journal = optarg;
+      break;
+    case 'Y':
+      if (auto const n = parse_count(optarg))
+      {
+        opts.journal_sync = *n;
+      }
+      else
+      {
+        std::cerr << "Invalid journal sync interval " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'j':
+    case 'L':
+    case 'Q':
+      if (auto const n = parse_count(optarg))
+      {
+        (c == 'j' ? opts.jobs : c == 'L' ? opts.io_limit : opts.readahead) = *n;
+      }
+      else
+      {
+        std::cerr << "Invalid number " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'T':
+      opts.stats = optarg;
+      break;
+    case 'P':
+      opts.perf = true;
+      break;
+    case 'R':
+      if (auto const n = parse_count(optarg))
+      {
+        opts.reorder_buffer_mib = *n;
+      }
+      else
+      {
+        std::cerr << "Invalid reorder buffer size " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'U':
+      opts.unordered = true;
+      break;
+    case 't':
+      if (auto const n = parse_count(optarg))
+      {
+        opts.timeout = std::chrono::seconds{*n};
+      }
+      else
+      {
+        std::cerr << "Invalid timeout " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'r':
+      if (auto value = unsigned{}; std::from_chars(optarg, optarg + std::strlen(optarg), value).ec == std::errc{})
+      {
+        opts.retries = value;
+      }
+      else
+      {
+        std::cerr << "Invalid retry count " << optarg << '\n';
+        return std::nullopt;
+      }
+      break;
+    case 'I':
+      opts.isolate = true;
+      break;
+    case 'W':
+      opts.pool_worker = true;
+      break;
+    case 'E':
+      opts.trace = optarg;
+      break;
+    case 'X':
+      opts.dedup_index = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return std::nullopt;
+    }
+  }
+
+  if (opts.times == chapter_times::nav_packs && opts.mode != output_mode::chapters &&
+      opts.mode != output_mode::streams)
+  {
+    std::cerr << "--nav-times only applies to chapter and stream output.\n";
+    return std::nullopt;
+  }
+
+  auto const num_args = argc - optind;
+  if (opts.merge_list)
+  {
+    if (num_args < 1)
+    {
+      print_usage(argv[0]);
+      return std::nullopt;
+    }
+    opts.merge_inputs.assign(argv + optind, argv + argc);
+    return opts;
+  }
+  if (opts.batch_list)
+  {
+    if (num_args != 0)
+    {
+      print_usage(argv[0]);
+      return std::nullopt;
+    }
+    if (opts.journal && !opts.output)
+    {
+      std::cerr << "--journal requires --output.\n";
+      return std::nullopt;
+    }
+    if (opts.perf && !opts.stats)
+    {
+      std::cerr << "--perf requires --stats.\n";
+      return std::nullopt;
+    }
+    if (opts.vob)
+    {
+      std::cerr << "--vob cannot be combined with --batch.\n";
+      return std::nullopt;
+    }
+    if (opts.dedup_index && opts.isolate)
+    {
+      std::cerr << "--dedup-index cannot be combined with --isolate.\n";
+      return std::nullopt;
+    }
+    if (opts.readahead && opts.direct_io)
+    {
+      std::cerr << "--readahead cannot be combined with --direct-io.\n";
+      return std::nullopt;
+    }
+    return opts;
+  }
+  if (opts.shard || opts.journal || opts.jobs > 1 || opts.stats || opts.perf || opts.isolate || opts.dedup_index ||
+      opts.readahead)
+  {
+    std::cerr << "--shard, --journal, --jobs, --stats, --perf, --isolate, --dedup-index and --readahead require "
+                 "--batch.\n";
+    return std::nullopt;
+  }
+
+  if (!(num_args == 1 || num_args == 2))
+  {
+    print_usage(argv[0]);
+    return std::nullopt;
+  }
+  opts.path = argv[optind];
+
+  if (num_args == 2)
+  {
+    try
+    {
+      auto title_parsed = std::stoi(argv[optind + 1]);
+      if (title_parsed < 0)
+      {
+        std::cerr << "Title cannot be a negative integer.\n";
+        return std::nullopt;
+      }
+      opts.title = static_cast<unsigned>(title_parsed);
+    }
+    catch (...)
+    {
+      std::cerr << "Could not convert " << argv[optind + 1] << " to integer\n";
+      return std::nullopt;
+    }
+  }
+
+  if (opts.main_only && opts.title != 0u)
+  {
+    std::cerr << "--main cannot be combined with a title number.\n";
+    return std::nullopt;
+  }
+  if (opts.vob && opts.title == 0u && !opts.main_only)
+  {
+    std::cerr << "--vob requires a title number or --main.\n";
+    return std::nullopt;
+  }
+  if (opts.vob && opts.vob == std::string_view{"-"} && !opts.output)
+  {
+    std::cerr << "--vob - requires --output.\n";
+    return std::nullopt;
+  }
+  // A pipe is read front to back once, the VOBs are long past by the time
+  // the IFOs are done with.
+  struct stat st;
+  if ((opts.vob || opts.times == chapter_times::nav_packs) &&
+      (opts.path == std::string_view{"-"} || (::stat(opts.path, &st) == 0 && S_ISFIFO(st.st_mode))))
+  {
+    std::cerr << "--vob and --nav-times cannot be used with a disc read from a pipe.\n";
+    return std::nullopt;
+  }
+  return opts;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  auto const opts = parse_options(argc, argv);
+  if (!opts)
+  {
+    return 1;
+  }
+
+  if (opts->perf)
+  {
+    perf_profiler::instance().enable();
+  }
+
+  auto &tracer = trace_recorder::instance();
+  if (opts->trace && !report_errors("", [&] { tracer.open(opts->trace, !opts->pool_worker); }))
+  {
+    return 1;
+  }
+  auto finish_trace = [&] { return report_errors("", [&] { tracer.finish(true); }); };
+  tracer.set_thread_name("main");
+
+  if (opts->pool_worker)
+  {
+    return run_pool_worker(*opts);
+  }
+  if (opts->merge_list || opts->batch_list)
+  {
+    auto ret = 1;
+    report_errors("", [&] { ret = opts->merge_list ? run_merge(*opts) : run_batch(*opts); });
+    return finish_trace() ? ret : 1;
+  }
+
+  auto logger = libdvdread_logger{};
+  auto const ok = report_errors("", [&] {
+    auto const out_file = open_output(opts->output ? opts->output : "");
+    auto &out = out_file ? static_cast<std::ostream &>(*out_file) : std::cout;
+    tracer.set_disc(opts->path);
+    process_disc(*opts, opts->path, logger, out);
+  });
+  if (!finish_trace() || !ok)
+  {
+    return 1;
+  }
+
+  logger.disable_report();
+}
+
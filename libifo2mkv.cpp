@@ -0,0 +1,2550 @@
+/*
+ Modified from original mkvtoolnix code by Daniel Kamil Kozar <dkk089@gmail.com>
+ Distributed under the GPL v2
+
+ This is pretty much code taken 1:1 from mkvtoolnix/src/common/chapters/dvd.cpp
+ I only made it runnable as a standalone application so really shouldn't take
+ any credit for it.
+
+ Original license statement from said file is reproduced below :
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+
+ helper functions for chapters on DVDs
+
+ Written by Moritz Bunkus <moritz@bunkus.org>.
+ */
+#include "libifo2mkv_internal.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <thread>
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <curl/curl.h>
+#include <dvdread/dvd_udf.h>
+#include <dvdread/nav_read.h>
+#include <zstd.h>
+
+namespace ifo2mkv
+{
+// libdvdread passes the same private pointer to the stream callbacks and to
+// pf_log, so it cannot be the stream or the logger alone.
+struct stream_context
+{
+  dvd_stream &stream;
+  libdvdread_logger &logger;
+
+  static int pf_seek_(void *p, uint64_t pos)
+  {
+    try
+    {
+      static_cast<stream_context *>(p)->stream.seek(pos);
+      return 0;
+    }
+    catch (...)
+    {
+      return -1;
+    }
+  }
+
+  static int pf_read_(void *p, void *buffer, int size)
+  {
+    try
+    {
+      return static_cast<stream_context *>(p)->stream.read(buffer, size);
+    }
+    catch (...)
+    {
+      return -1;
+    }
+  }
+
+  static void pf_log_(void *p, dvd_logger_level_t lvl, char const *fmt, va_list args)
+  {
+    auto &logger = static_cast<stream_context *>(p)->logger;
+    logger.pf_log(&logger, lvl, fmt, args);
+  }
+
+  static inline dvd_reader_stream_cb callbacks{pf_seek_, pf_read_, nullptr};
+  static inline dvd_logger_cb const logger_callbacks{pf_log_};
+};
+
+namespace
+{
+std::string_view lvl_to_str(dvd_logger_level_t lvl)
+{
+  switch (lvl)
+  {
+  case DVD_LOGGER_LEVEL_INFO:
+    return "INFO";
+  case DVD_LOGGER_LEVEL_ERROR:
+    return "ERROR";
+  case DVD_LOGGER_LEVEL_WARN:
+    return "WARN";
+  case DVD_LOGGER_LEVEL_DEBUG:
+    return "DEBUG";
+  default:
+    return "unknown";
+  }
+}
+
+using block_buffer = std::unique_ptr<unsigned char, decltype(&::free)>;
+
+// Aligned for the O_DIRECT reads libdvdread may do.
+block_buffer alloc_blocks(size_t count)
+{
+  auto const size = count * DVD_VIDEO_LB_LEN;
+  auto buffer = block_buffer{static_cast<unsigned char *>(std::aligned_alloc(DVD_VIDEO_LB_LEN, size)), &::free};
+  if (!buffer)
+  {
+    throw std::bad_alloc{};
+  }
+  return buffer;
+}
+
+// Reader for images compressed with the zstd seekable format : a sequence of
+// independent zstd frames followed by a skippable frame holding the seek table.
+// Only the frames that libdvdread actually touches (UDF descriptors, IFOs) are
+// ever decompressed, and a handful of them are kept around since UDF and IFO
+// reads tend to cluster.
+struct zstd_seekable_stream : public dvd_stream
+{
+  zstd_seekable_stream(char const *path) : fd_(open_file(path)), dctx_(::ZSTD_createDCtx(), &::ZSTD_freeDCtx)
+  {
+    if (!dctx_)
+    {
+      throw stream_exception("Failed to create zstd decompression context");
+    }
+    read_seek_table(path);
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    auto out = static_cast<uint8_t *>(buffer);
+    auto done = 0;
+    while (done < size && pos_ < decompressed_offsets_.back())
+    {
+      auto const it = std::upper_bound(decompressed_offsets_.begin(), decompressed_offsets_.end(), pos_);
+      auto const idx = static_cast<size_t>(it - decompressed_offsets_.begin()) - 1;
+      auto const &frame = get_frame(idx);
+      auto const offset_in_frame = static_cast<size_t>(pos_ - decompressed_offsets_[idx]);
+      auto const chunk = std::min(frame.size() - offset_in_frame, static_cast<size_t>(size - done));
+      std::memcpy(out + done, frame.data() + offset_in_frame, chunk);
+      done += static_cast<int>(chunk);
+      pos_ += chunk;
+    }
+    return done;
+  }
+
+private:
+  static constexpr uint32_t skippable_magic = 0x184D2A5E;
+  static constexpr uint32_t seekable_magic = 0x8F92EAB1;
+  static constexpr size_t footer_size = 9;
+  static constexpr size_t max_cached_frames = 8;
+
+  static uint32_t read_le32(uint8_t const *p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  void pread_exact(void *buffer, size_t size, uint64_t offset) const
+  {
+    auto const ret = ::pread(fd_.get(), buffer, size, static_cast<off_t>(offset));
+    if (ret < 0 || static_cast<size_t>(ret) != size)
+    {
+      throw stream_exception(std::format("Short read at offset {}", offset));
+    }
+  }
+
+  void read_seek_table(char const *path)
+  {
+    struct stat st;
+    if (::fstat(fd_.get(), &st) != 0 || static_cast<uint64_t>(st.st_size) < footer_size + 8)
+    {
+      throw stream_exception(std::format("{} is not a seekable zstd file", path));
+    }
+    auto const file_size = static_cast<uint64_t>(st.st_size);
+
+    uint8_t footer[footer_size];
+    pread_exact(footer, sizeof(footer), file_size - footer_size);
+    if (read_le32(footer + 5) != seekable_magic)
+    {
+      throw stream_exception(std::format("{} has no zstd seek table", path));
+    }
+    auto const num_frames = read_le32(footer);
+    auto const entry_size = (footer[4] & 0x80) ? 12u : 8u;
+    auto const table_size = static_cast<uint64_t>(num_frames) * entry_size + footer_size;
+    if (table_size + 8 > file_size)
+    {
+      throw stream_exception(std::format("{} has a truncated zstd seek table", path));
+    }
+
+    std::vector<uint8_t> table(table_size + 8);
+    pread_exact(table.data(), table.size(), file_size - table.size());
+    if (read_le32(table.data()) != skippable_magic || read_le32(table.data() + 4) != table_size)
+    {
+      throw stream_exception(std::format("{} has a malformed zstd seek table", path));
+    }
+
+    compressed_offsets_.reserve(num_frames + 1);
+    decompressed_offsets_.reserve(num_frames + 1);
+    compressed_offsets_.push_back(0);
+    decompressed_offsets_.push_back(0);
+    for (auto entry = table.data() + 8; entry < table.data() + 8 + num_frames * entry_size; entry += entry_size)
+    {
+      compressed_offsets_.push_back(compressed_offsets_.back() + read_le32(entry));
+      decompressed_offsets_.push_back(decompressed_offsets_.back() + read_le32(entry + 4));
+    }
+  }
+
+  std::vector<uint8_t> const &get_frame(size_t idx)
+  {
+    auto const it = std::find_if(cache_.begin(), cache_.end(), [idx](auto &&f) { return f.first == idx; });
+    if (it != cache_.end())
+    {
+      cache_.splice(cache_.begin(), cache_, it);
+      return cache_.front().second;
+    }
+
+    std::vector<uint8_t> compressed(compressed_offsets_[idx + 1] - compressed_offsets_[idx]);
+    pread_exact(compressed.data(), compressed.size(), compressed_offsets_[idx]);
+    std::vector<uint8_t> frame(decompressed_offsets_[idx + 1] - decompressed_offsets_[idx]);
+    auto const ret =
+        ::ZSTD_decompressDCtx(dctx_.get(), frame.data(), frame.size(), compressed.data(), compressed.size());
+    if (::ZSTD_isError(ret) || ret != frame.size())
+    {
+      throw stream_exception(std::format("Failed to decompress zstd frame {}", idx));
+    }
+
+    if (cache_.size() == max_cached_frames)
+    {
+      cache_.pop_back();
+    }
+    cache_.emplace_front(idx, std::move(frame));
+    return cache_.front().second;
+  }
+
+  unique_fd fd_;
+  std::unique_ptr<ZSTD_DCtx, decltype(&::ZSTD_freeDCtx)> dctx_;
+  std::vector<uint64_t> compressed_offsets_;
+  std::vector<uint64_t> decompressed_offsets_;
+  std::list<std::pair<size_t, std::vector<uint8_t>>> cache_;
+  uint64_t pos_ = 0;
+};
+
+// Plain image file or block device. libdvdread can read these by itself, this
+// is only used when the reads need to go through another stream.
+struct file_stream : public dvd_stream
+{
+  file_stream(char const *path) : fd_(open_file(path))
+  {
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    auto done = 0;
+    while (done < size)
+    {
+      auto const ret = ::pread(fd_.get(), static_cast<uint8_t *>(buffer) + done, static_cast<size_t>(size - done),
+                               static_cast<off_t>(pos_));
+      if (ret < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (ret < 0)
+      {
+        throw stream_exception(std::format("Read failed at offset {} : {}", pos_, std::strerror(errno)));
+      }
+      if (ret == 0)
+      {
+        break;
+      }
+      done += static_cast<int>(ret);
+      pos_ += static_cast<uint64_t>(ret);
+    }
+    return done;
+  }
+
+private:
+  unique_fd fd_;
+  uint64_t pos_ = 0;
+};
+
+// Chunk buffers of the direct_streams. With --jobs every disc opens a stream of
+// its own, so buffers are handed on to the next disc rather than freed.
+struct direct_buffer_pool
+{
+  // O_DIRECT wants buffers, offsets and sizes aligned to the logical block
+  // size of the device, which is at most a page on anything around.
+  static constexpr size_t alignment = 4096;
+  static constexpr size_t buffer_size = 256 * 1024;
+
+  static direct_buffer_pool &instance()
+  {
+    static auto pool = direct_buffer_pool{};
+    return pool;
+  }
+
+  block_buffer acquire()
+  {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      if (!free_.empty())
+      {
+        auto buffer = std::move(free_.back());
+        free_.pop_back();
+        return buffer;
+      }
+    }
+    auto buffer = block_buffer{static_cast<unsigned char *>(std::aligned_alloc(alignment, buffer_size)), &::free};
+    if (!buffer)
+    {
+      throw std::bad_alloc{};
+    }
+    return buffer;
+  }
+
+  void release(block_buffer buffer) noexcept
+  {
+    auto const lock = std::lock_guard{mutex_};
+    if (free_.size() < max_free)
+    {
+      free_.push_back(std::move(buffer));
+    }
+  }
+
+private:
+  static constexpr size_t max_free = 64;
+
+  direct_buffer_pool()
+  {
+    // So that release() never allocates.
+    free_.reserve(max_free);
+  }
+
+  std::mutex mutex_;
+  std::vector<block_buffer> free_;
+};
+
+// Image file or block device read with O_DIRECT, so that scanning discs does
+// not evict the data other programs have in the page cache. Reads go through
+// an aligned chunk, which also serves the many single sector reads libdvdread
+// does while walking the UDF structures. Filesystems that do not support
+// O_DIRECT (tmpfs, many FUSE and network filesystems) refuse it with EINVAL,
+// either when opening or at the first read, and are then read buffered.
+struct direct_stream : public dvd_stream
+{
+  direct_stream(char const *path) : fd_(open_direct(path)), chunk_(direct_buffer_pool::instance().acquire())
+  {
+  }
+
+  ~direct_stream() override
+  {
+    direct_buffer_pool::instance().release(std::move(chunk_));
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    auto done = 0;
+    while (done < size)
+    {
+      if (pos_ < chunk_start_ || pos_ >= chunk_start_ + chunk_filled_)
+      {
+        fill_chunk(pos_ - pos_ % direct_buffer_pool::alignment);
+        if (pos_ >= chunk_start_ + chunk_filled_)
+        {
+          break;
+        }
+      }
+      auto const offset = static_cast<size_t>(pos_ - chunk_start_);
+      auto const n = std::min(chunk_filled_ - offset, static_cast<size_t>(size - done));
+      std::memcpy(static_cast<uint8_t *>(buffer) + done, chunk_.get() + offset, n);
+      done += static_cast<int>(n);
+      pos_ += n;
+    }
+    return done;
+  }
+
+private:
+  static unique_fd open_direct(char const *path)
+  {
+    auto fd = unique_fd{::open(path, O_RDONLY | O_DIRECT | O_CLOEXEC)};
+    if (fd.get() < 0 && errno == EINVAL)
+    {
+      return open_file(path);
+    }
+    if (fd.get() < 0)
+    {
+      throw stream_exception(std::format("Failed to open {} : {}", path, std::strerror(errno)));
+    }
+    return fd;
+  }
+
+  void fill_chunk(uint64_t start)
+  {
+    chunk_start_ = start;
+    chunk_filled_ = 0;
+    while (chunk_filled_ < direct_buffer_pool::buffer_size)
+    {
+      auto const ret = ::pread(fd_.get(), chunk_.get() + chunk_filled_, direct_buffer_pool::buffer_size - chunk_filled_,
+                               static_cast<off_t>(start + chunk_filled_));
+      if (ret < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (ret < 0 && errno == EINVAL && drop_direct())
+      {
+        continue;
+      }
+      if (ret < 0)
+      {
+        throw stream_exception(
+            std::format("Read failed at offset {} : {}", start + chunk_filled_, std::strerror(errno)));
+      }
+      if (ret == 0)
+      {
+        break;
+      }
+      chunk_filled_ += static_cast<size_t>(ret);
+      if (chunk_filled_ % direct_buffer_pool::alignment != 0)
+      {
+        // Only the end of the file comes short of a block, and reading on
+        // from an unaligned offset would fail.
+        break;
+      }
+    }
+  }
+
+  // Returns whether O_DIRECT was still set.
+  bool drop_direct()
+  {
+    auto const flags = ::fcntl(fd_.get(), F_GETFL);
+    return flags >= 0 && (flags & O_DIRECT) && ::fcntl(fd_.get(), F_SETFL, flags & ~O_DIRECT) == 0;
+  }
+
+  unique_fd fd_;
+  block_buffer chunk_;
+  uint64_t chunk_start_ = 0;
+  size_t chunk_filled_ = 0;
+  uint64_t pos_ = 0;
+};
+
+// Image read from a pipe, which only goes front to back and is never read
+// further than libdvdread asked for. What it asks for mostly lies near the
+// start of the image (UDF structures, the VMG), except for the IFO of every
+// title set past the first, which sits in front of the VOBs of its title set.
+// So what is read of the first keep_start bytes is kept, as are the keep_after
+// bytes following a requested position past those, enough for reading an
+// IFO's tables in whatever order; the rest is skipped over. A multi-GB image thus
+// takes a few MiB, but seeking back to a skipped part fails.
+struct pipe_stream : public dvd_stream
+{
+  pipe_stream(unique_fd fd) : fd_(std::move(fd))
+  {
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  bool forward_only() const override
+  {
+    return true;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    auto const end = pos_ + static_cast<uint64_t>(size);
+    if (pos_ >= keep_until_)
+    {
+      keep_from_ = pos_;
+    }
+    keep_until_ = std::max({keep_until_, pos_ + keep_after, end});
+    while (consumed_ < end && !at_eof_)
+    {
+      read_chunk();
+    }
+
+    auto done = 0;
+    for (; pos_ < std::min(end, consumed_);)
+    {
+      auto const it = chunks_.find(pos_ / chunk_size);
+      if (it == chunks_.end())
+      {
+        throw stream_exception(std::format("Cannot seek back to offset {} of a pipe", pos_));
+      }
+      auto const offset = static_cast<size_t>(pos_ % chunk_size);
+      auto const n = std::min(it->second.size() - offset, static_cast<size_t>(end - pos_));
+      std::memcpy(static_cast<uint8_t *>(buffer) + done, it->second.data() + offset, n);
+      done += static_cast<int>(n);
+      pos_ += n;
+    }
+    return done;
+  }
+
+private:
+  static constexpr size_t chunk_size = 64 * 1024;
+  static constexpr uint64_t keep_start = 16 * 1024 * 1024;
+  static constexpr uint64_t keep_after = 8 * 1024 * 1024;
+
+  void read_chunk()
+  {
+    auto const keep = consumed_ < keep_start || (consumed_ + chunk_size > keep_from_ && consumed_ < keep_until_);
+    auto &chunk = keep ? chunks_[consumed_ / chunk_size] : scratch_;
+    chunk.resize(chunk_size);
+    auto filled = size_t{0};
+    while (filled < chunk_size)
+    {
+      auto const ret = ::read(fd_.get(), chunk.data() + filled, chunk_size - filled);
+      if (ret < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (ret < 0)
+      {
+        throw stream_exception(std::format("Read failed at offset {} : {}", consumed_ + filled, std::strerror(errno)));
+      }
+      if (ret == 0)
+      {
+        at_eof_ = true;
+        break;
+      }
+      filled += static_cast<size_t>(ret);
+    }
+    chunk.resize(filled);
+    consumed_ += filled;
+  }
+
+  unique_fd fd_;
+  std::map<uint64_t, std::vector<uint8_t>> chunks_;
+  std::vector<uint8_t> scratch_;
+  uint64_t consumed_ = 0;
+  uint64_t keep_from_ = 0;
+  uint64_t keep_until_ = 0;
+  uint64_t pos_ = 0;
+  bool at_eof_ = false;
+};
+
+// DNS and connection caches shared by the http_streams of all threads, so that
+// the discs of a batch served from the same host reuse kept-alive connections
+// instead of each opening their own.
+struct curl_share
+{
+  static CURLSH *get()
+  {
+    static auto share = curl_share{};
+    return share.handle_.get();
+  }
+
+private:
+  curl_share() : handle_(nullptr, &::curl_share_cleanup)
+  {
+    if (::curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    {
+      throw stream_exception("Failed to initialize libcurl");
+    }
+    handle_.reset(::curl_share_init());
+    if (!handle_)
+    {
+      throw stream_exception("Failed to create a curl share handle");
+    }
+    ::curl_share_setopt(handle_.get(), CURLSHOPT_LOCKFUNC, &lock);
+    ::curl_share_setopt(handle_.get(), CURLSHOPT_UNLOCKFUNC, &unlock);
+    ::curl_share_setopt(handle_.get(), CURLSHOPT_USERDATA, this);
+    ::curl_share_setopt(handle_.get(), CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    ::curl_share_setopt(handle_.get(), CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
+
+  static void lock(CURL *, curl_lock_data data, curl_lock_access, void *p)
+  {
+    static_cast<curl_share *>(p)->mutexes_[data].lock();
+  }
+
+  static void unlock(CURL *, curl_lock_data data, void *p)
+  {
+    static_cast<curl_share *>(p)->mutexes_[data].unlock();
+  }
+
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> mutexes_;
+  std::unique_ptr<CURLSH, decltype(&::curl_share_cleanup)> handle_;
+};
+
+// Image served over HTTP, e.g. by the gateway of an object store, read with
+// Range requests for only what libdvdread asks for. Reads are rounded to
+// blocks of block_size, so that the single sectors of the UDF walk and the
+// small tables of an IFO mostly share a request, and the blocks missing for a
+// read are fetched in a single request. The size of the image comes with the
+// Content-Range of the first response, no HEAD request is needed (presigned
+// URLs usually only allow GET).
+struct http_stream : public dvd_stream
+{
+  http_stream(char const *url) : url_(url), curl_(::curl_easy_init(), &::curl_easy_cleanup)
+  {
+    if (!curl_)
+    {
+      throw stream_exception("Failed to create a curl handle");
+    }
+    auto const curl = curl_.get();
+    ::curl_easy_setopt(curl, CURLOPT_URL, url);
+    ::curl_easy_setopt(curl, CURLOPT_SHARE, curl_share::get());
+    ::curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_);
+    ::curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    ::curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    ::curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    ::curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    ::curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &on_header);
+    ::curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+    ::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &on_body);
+    ::curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    auto const end = pos_ + static_cast<uint64_t>(size);
+    auto done = 0;
+    while (pos_ < end && (!size_ || pos_ < *size_))
+    {
+      auto const idx = pos_ / block_size;
+      auto block = find_block(idx);
+      if (!block)
+      {
+        auto count = uint64_t{1};
+        while (count < max_blocks_per_request && (idx + count) * block_size < end && !find_block(idx + count))
+        {
+          ++count;
+        }
+        fetch(idx, count);
+        block = find_block(idx);
+      }
+      auto const offset = static_cast<size_t>(pos_ % block_size);
+      if (!block || offset >= block->size())
+      {
+        break;
+      }
+      auto const n = std::min(block->size() - offset, static_cast<size_t>(end - pos_));
+      std::memcpy(static_cast<uint8_t *>(buffer) + done, block->data() + offset, n);
+      done += static_cast<int>(n);
+      pos_ += n;
+    }
+    return done;
+  }
+
+private:
+  static constexpr uint64_t block_size = 32 * 1024;
+  static constexpr uint64_t max_blocks_per_request = 32;
+  static constexpr size_t max_cached_blocks = 128;
+
+  static size_t on_header(char *data, size_t size, size_t count, void *p)
+  {
+    auto const self = static_cast<http_stream *>(p);
+    auto const line = std::string_view{data, size * count};
+    constexpr auto name = std::string_view{"content-range:"};
+    if (line.size() > name.size() &&
+        std::equal(name.begin(), name.end(), line.begin(),
+                   [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); }))
+    {
+      // bytes FIRST-LAST/SIZE, or bytes */SIZE past the end.
+      auto const slash = line.find('/');
+      auto size = uint64_t{};
+      if (slash != std::string_view::npos &&
+          std::from_chars(line.data() + slash + 1, line.data() + line.size(), size).ec == std::errc{})
+      {
+        self->size_ = size;
+      }
+    }
+    return size * count;
+  }
+
+  static size_t on_body(char *data, size_t size, size_t count, void *p)
+  {
+    auto const self = static_cast<http_stream *>(p);
+    auto status = long{};
+    ::curl_easy_getinfo(self->curl_.get(), CURLINFO_RESPONSE_CODE, &status);
+    if (status != 206 || self->body_.size() + size * count > self->body_limit_)
+    {
+      // Do not download a whole image from a server that ignores the range.
+      return 0;
+    }
+    self->body_.insert(self->body_.end(), data, data + size * count);
+    return size * count;
+  }
+
+  std::vector<uint8_t> const *find_block(uint64_t idx)
+  {
+    auto const it = std::find_if(cache_.begin(), cache_.end(), [idx](auto &&b) { return b.first == idx; });
+    if (it == cache_.end())
+    {
+      return nullptr;
+    }
+    cache_.splice(cache_.begin(), cache_, it);
+    return &cache_.front().second;
+  }
+
+  void fetch(uint64_t first, uint64_t count)
+  {
+    auto const range = std::format("{}-{}", first * block_size, (first + count) * block_size - 1);
+    ::curl_easy_setopt(curl_.get(), CURLOPT_RANGE, range.c_str());
+    body_.clear();
+    body_limit_ = count * block_size;
+    error_[0] = '\0';
+    auto const ret = ::curl_easy_perform(curl_.get());
+    auto status = long{};
+    ::curl_easy_getinfo(curl_.get(), CURLINFO_RESPONSE_CODE, &status);
+    if (status == 416)
+    {
+      // Past the end, size_ now holds the size of the image.
+      return;
+    }
+    if (status == 200)
+    {
+      throw stream_exception(std::format("{} does not support range requests", url_));
+    }
+    if (status != 206 && status != 0)
+    {
+      throw stream_exception(std::format("Request for {} of {} failed : HTTP status {}", range, url_, status));
+    }
+    if (ret != CURLE_OK)
+    {
+      throw stream_exception(
+          std::format("Request for {} of {} failed : {}", range, url_, *error_ ? error_ : ::curl_easy_strerror(ret)));
+    }
+
+    for (auto offset = size_t{0}; offset < body_.size(); offset += block_size)
+    {
+      if (cache_.size() == max_cached_blocks)
+      {
+        cache_.pop_back();
+      }
+      auto const block_end = body_.begin() + static_cast<ptrdiff_t>(std::min(offset + block_size, body_.size()));
+      cache_.emplace_front(first++, std::vector<uint8_t>(body_.begin() + static_cast<ptrdiff_t>(offset), block_end));
+    }
+  }
+
+  std::string url_;
+  std::unique_ptr<CURL, decltype(&::curl_easy_cleanup)> curl_;
+  char error_[CURL_ERROR_SIZE] = {};
+  std::vector<uint8_t> body_;
+  size_t body_limit_ = 0;
+  std::list<std::pair<uint64_t, std::vector<uint8_t>>> cache_;
+  std::optional<uint64_t> size_;
+  uint64_t pos_ = 0;
+};
+
+// Runs the reads of another stream on a helper thread, so that a read hanging
+// on a scratched disc or a dead NFS server can be given up on once the
+// deadline passes. From then on every call fails right away, which makes
+// libdvdread bail out. The helper thread is left behind to finish the hung
+// read on its own, reading into a buffer of its own since the caller's is
+// long gone by then.
+struct deadline_stream : public dvd_stream
+{
+  deadline_stream(std::unique_ptr<dvd_stream> inner, deadline_clock::time_point deadline)
+      : state_(std::make_shared<io_state>(std::move(inner))), deadline_(deadline)
+  {
+    thread_ = std::thread{[state = state_] { state->run(); }};
+  }
+
+  ~deadline_stream() override
+  {
+    {
+      auto const lock = std::lock_guard{state_->mutex};
+      state_->quit = true;
+    }
+    state_->cv.notify_all();
+    if (timed_out_)
+    {
+      thread_.detach();
+    }
+    else
+    {
+      thread_.join();
+    }
+  }
+
+  void seek(uint64_t pos) override
+  {
+    pos_ = pos;
+  }
+
+  int read(void *buffer, int size) override
+  {
+    if (timed_out_)
+    {
+      throw timeout_exception("Deadline passed");
+    }
+    auto lock = std::unique_lock{state_->mutex};
+    state_->pos = pos_;
+    state_->size = size;
+    state_->has_request = true;
+    state_->cv.notify_all();
+    if (!state_->cv.wait_until(lock, deadline_, [this] { return state_->has_result; }))
+    {
+      timed_out_ = true;
+      throw timeout_exception("Deadline passed");
+    }
+    state_->has_result = false;
+    if (state_->result < 0)
+    {
+      return -1;
+    }
+    std::memcpy(buffer, state_->buffer.data(), static_cast<size_t>(state_->result));
+    pos_ += static_cast<uint64_t>(state_->result);
+    return state_->result;
+  }
+
+  bool timed_out() const override
+  {
+    return timed_out_;
+  }
+
+  bool forward_only() const override
+  {
+    return state_->inner->forward_only();
+  }
+
+private:
+  struct io_state
+  {
+    io_state(std::unique_ptr<dvd_stream> inner) : inner(std::move(inner))
+    {
+    }
+
+    void run()
+    {
+      auto lock = std::unique_lock{mutex};
+      for (;;)
+      {
+        cv.wait(lock, [this] { return has_request || quit; });
+        if (quit)
+        {
+          return;
+        }
+        has_request = false;
+        auto const req_pos = pos;
+        auto const req_size = size;
+        lock.unlock();
+
+        auto ret = -1;
+        try
+        {
+          buffer.resize(static_cast<size_t>(req_size));
+          inner->seek(req_pos);
+          ret = inner->read(buffer.data(), req_size);
+        }
+        catch (...)
+        {
+        }
+
+        lock.lock();
+        result = ret;
+        has_result = true;
+        cv.notify_all();
+      }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unique_ptr<dvd_stream> inner;
+    std::vector<uint8_t> buffer;
+    uint64_t pos = 0;
+    int size = 0;
+    int result = 0;
+    bool has_request = false;
+    bool has_result = false;
+    bool quit = false;
+  };
+
+  std::shared_ptr<io_state> state_;
+  deadline_clock::time_point deadline_;
+  std::thread thread_;
+  uint64_t pos_ = 0;
+  bool timed_out_ = false;
+};
+
+// Appends str to escaped, escaped for use within a JSON string, whichever
+// allocator escaped uses.
+template <typename String> void append_json_escaped(String &escaped, std::string_view str)
+{
+  for (auto c : str)
+  {
+    switch (c)
+    {
+    case '"':
+      escaped += "\\\"";
+      break;
+    case '\\':
+      escaped += "\\\\";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20)
+      {
+        std::format_to(std::back_inserter(escaped), "\\u{:04x}", static_cast<unsigned>(c));
+      }
+      else
+      {
+        escaped += c;
+      }
+    }
+  }
+}
+
+std::pmr::string json_escape(std::string_view str, std::pmr::memory_resource *mr)
+{
+  auto escaped = std::pmr::string{mr};
+  escaped.reserve(str.size());
+  append_json_escaped(escaped, str);
+  return escaped;
+}
+
+// The fingerprint field, or nothing, to follow the disc field with.
+std::pmr::string fingerprint_field(std::string_view fingerprint, std::pmr::memory_resource *mr)
+{
+  auto field = std::pmr::string{mr};
+  if (!fingerprint.empty())
+  {
+    field += R"(,"fingerprint":")";
+    append_json_escaped(field, fingerprint);
+    field += '"';
+  }
+  return field;
+}
+
+// Event counters of the calling thread, as one perf_event_open(2) group so
+// that they are read with a single syscall. Hardware events are unavailable
+// in many virtual machines and under a strict perf_event_paranoid, the group
+// is then led by the software task clock instead. Context switches and page
+// faults that cannot be counted that way are taken from getrusage(2).
+struct perf_sampler
+{
+  static perf_sampler &thread_instance()
+  {
+    thread_local auto sampler = perf_sampler{};
+    return sampler;
+  }
+
+  perf_values read() const
+  {
+    auto values = perf_values{};
+    if (!fds_.empty())
+    {
+      auto buf = std::array<uint64_t, 1 + num_perf_counters + 1>{};
+      if (::read(fds_.front().get(), buf.data(), sizeof(buf)) > 0)
+      {
+        for (auto i = size_t{0}; i < std::min<size_t>(buf[0], slots_.size()); ++i)
+        {
+          if (slots_[i] < num_perf_counters)
+          {
+            values[slots_[i]] = buf[1 + i];
+          }
+        }
+      }
+    }
+    if (!values[perf_context_switches] || !values[perf_page_faults])
+    {
+      auto ru = ::rusage{};
+      if (::getrusage(RUSAGE_THREAD, &ru) == 0)
+      {
+        values[perf_context_switches] = values[perf_context_switches].value_or(ru.ru_nvcsw + ru.ru_nivcsw);
+        values[perf_page_faults] = values[perf_page_faults].value_or(ru.ru_minflt + ru.ru_majflt);
+      }
+    }
+    return values;
+  }
+
+private:
+  perf_sampler()
+  {
+    static constexpr std::pair<uint32_t, uint64_t> events[num_perf_counters] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+    for (auto c = size_t{0}; c < num_perf_counters; ++c)
+    {
+      if (!add(events[c].first, events[c].second, c) && fds_.empty())
+      {
+        add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, num_perf_counters);
+      }
+    }
+  }
+
+  bool add(uint32_t type, uint64_t config, size_t slot)
+  {
+    auto attr = ::perf_event_attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    // Software events are raised in the kernel, excluding it would hide them.
+    attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv = 1;
+    auto const group = fds_.empty() ? -1 : fds_.front().get();
+    auto fd = unique_fd{static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC))};
+    if (fd.get() < 0)
+    {
+      return false;
+    }
+    fds_.push_back(std::move(fd));
+    slots_.push_back(slot);
+    return true;
+  }
+
+  std::vector<unique_fd> fds_;
+  std::vector<size_t> slots_; // counter of each group member, in group order
+};
+
+struct perf_disc_state
+{
+  bool active = false;
+  std::optional<perf_phase> current;
+  perf_values last;
+  perf_phases counts;
+};
+
+perf_disc_state &thread_perf_disc()
+{
+  thread_local auto state = perf_disc_state{};
+  return state;
+}
+
+void charge(perf_disc_state &state)
+{
+  auto const now = perf_sampler::thread_instance().read();
+  if (state.current)
+  {
+    add_counts(state.counts[*state.current], diff_counts(now, state.last));
+  }
+  state.last = now;
+}
+
+// Has the kernel start reading every IFO of the disc at path into the page
+// cache, so that the reads of the IFOs as they get parsed overlap instead of
+// each waiting for the one before, a round trip each on rotational or network
+// storage. An image is located through its UDF file system, which dvd has
+// already read. BUPs are left out, libdvdread only reads them when an IFO is
+// damaged. Inputs read through a stream are not in the page cache to begin
+// with and must not be passed here.
+void advise_ifos(dvd_reader_t &dvd, char const *path)
+{
+  struct stat st;
+  if (::stat(path, &st) != 0)
+  {
+    return;
+  }
+
+  if (S_ISDIR(st.st_mode))
+  {
+    // path is either the VIDEO_TS folder or the one holding it.
+    auto const close_dir = [](DIR *dir) { ::closedir(dir); };
+    auto dir = std::unique_ptr<DIR, decltype(close_dir)>{::opendir(std::format("{}/VIDEO_TS", path).c_str())};
+    if (!dir)
+    {
+      dir.reset(::opendir(path));
+    }
+    if (!dir)
+    {
+      return;
+    }
+    while (auto const entry = ::readdir(dir.get()))
+    {
+      auto const name = std::string_view{entry->d_name};
+      if (name.size() > 4 && ::strcasecmp(name.data() + name.size() - 4, ".IFO") == 0)
+      {
+        auto const fd = unique_fd{::openat(::dirfd(dir.get()), entry->d_name, O_RDONLY | O_CLOEXEC)};
+        if (fd.get() >= 0)
+        {
+          ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_WILLNEED);
+        }
+      }
+    }
+  }
+  else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+  {
+    auto const fd = unique_fd{::open(path, O_RDONLY | O_CLOEXEC)};
+    if (fd.get() < 0)
+    {
+      return;
+    }
+    // Title sets are numbered without gaps.
+    for (auto title_set = 0; title_set < 100; ++title_set)
+    {
+      auto const name =
+          title_set == 0 ? std::string{"/VIDEO_TS/VIDEO_TS.IFO"} : std::format("/VIDEO_TS/VTS_{:02}_0.IFO", title_set);
+      auto size = uint32_t{};
+      auto const sector = ::UDFFindFile(&dvd, name.c_str(), &size);
+      if (sector == 0)
+      {
+        break;
+      }
+      ::posix_fadvise(fd.get(), static_cast<off_t>(sector) * DVD_VIDEO_LB_LEN, size, POSIX_FADV_WILLNEED);
+    }
+  }
+}
+
+auto dvd_open(char const *path, stream_context *context, libdvdread_logger &logger)
+{
+  auto const span = trace_span{"dvd_open"};
+  auto const perf = perf_scope{perf_open};
+  auto const dvd = context ? ::DVDOpenStream2(context, &stream_context::logger_callbacks, &stream_context::callbacks)
+                           : ::DVDOpen2(&logger, &logger, path);
+  if (dvd)
+  {
+    if (!context)
+    {
+      advise_ifos(*dvd, path);
+    }
+    return dvd_uptr{dvd, [](auto p) {
+                      if (p)
+                      {
+                        ::DVDClose(p);
+                      }
+                    }};
+  }
+  else
+  {
+    throw libdvdread_exception(std::format("Failed to open DVD structure under {}", path));
+  }
+}
+
+auto ifo_open(dvd_reader_t &dvd, int title)
+{
+  auto const span = title == 0 ? trace_span{"ifo_open VMG"} : trace_span{"ifo_open VTS", "title_set", title};
+  auto const perf = perf_scope{perf_parse};
+  if (auto const ifo = ::ifoOpen(&dvd, title))
+  {
+    return ifo_uptr{ifo, [](auto p) {
+                      if (p)
+                      {
+                        ::ifoClose(p);
+                      }
+                    }};
+  }
+  else
+  {
+    throw libdvdread_exception(std::format("Failed to open IFO for title {}", title));
+  }
+}
+
+using dvd_file_uptr = std::unique_ptr<dvd_file_t, decltype(&::DVDCloseFile)>;
+auto dvd_file_open(dvd_reader_t &dvd, int title_set, dvd_read_domain_t domain = DVD_READ_TITLE_VOBS)
+{
+  if (auto const file = ::DVDOpenFile(&dvd, title_set, domain))
+  {
+    return dvd_file_uptr{file, [](auto p) {
+                           if (p)
+                           {
+                             ::DVDCloseFile(p);
+                           }
+                         }};
+  }
+  else
+  {
+    throw libdvdread_exception(std::format("Failed to open the {} of title set {}",
+                                           domain == DVD_READ_INFO_FILE ? "IFO" : "VOBs", title_set));
+  }
+}
+
+std::string format_timestamp(int32_t timestamp_ms)
+{
+  auto const hr = timestamp_ms / 3600000;
+  auto const min = (timestamp_ms / 60000) % 60;
+  auto const sec = (timestamp_ms / 1000) % 60;
+  auto const ms = timestamp_ms % 1000;
+  return std::format("{:02}:{:02}:{:02}.{:03}", hr, min, sec, ms);
+}
+
+int32_t frames_to_timestamp_ms(unsigned int num_frames, unsigned int fps)
+{
+  auto factor = fps == 30 ? 1001 : 1000;
+  return static_cast<int32_t>(factor * num_frames / (fps ? fps : 1));
+}
+
+template <typename T> constexpr T from_bcd(T val)
+{
+  return (((val & 0xf0) >> 4) * 10) + (val & 0x0f);
+}
+
+struct frame_count
+{
+  unsigned frames;
+  unsigned fps;
+};
+
+frame_count dvd_time_to_frames(dvd_time_t const &dt)
+{
+  auto hour = from_bcd(dt.hour);
+  auto minute = from_bcd(dt.minute);
+  auto second = from_bcd(dt.second);
+  auto fps = ((dt.frame_u & 0xc0) >> 6) == 1 ? 25u : 30u; // by definition
+  auto frames = ((hour * 60 * 60) + minute * 60 + second) * fps;
+  frames += ((dt.frame_u & 0x30) >> 4) * 10 + (dt.frame_u & 0x0f);
+  return {frames, fps};
+}
+
+// Where chapter ptt (0-based) of a VTS title starts : its PGC, and the first
+// cell (0-based) of its program.
+struct ptt_target
+{
+  int pgcn;
+  int pgn;
+  pgc_t const *pgc;
+  int first_cell;
+};
+
+// Looks up where chapter ptt of the given VTS title starts, or returns nullopt
+// if any of the indices on the way from the PTT table to the cell is out of
+// range. Everything reading chapters goes through here, so that a corrupt or
+// deliberately broken IFO cannot make them index past its tables.
+std::optional<ptt_target> ptt_pgc(ifo_handle_t const &vts, int ttn, int ptt)
+{
+  auto const ptt_srpt = vts.vts_ptt_srpt;
+  auto const pgcit = vts.vts_pgcit;
+  if (!ptt_srpt || !pgcit || ttn < 1 || ttn > ptt_srpt->nr_of_srpts || ptt < 0 ||
+      ptt >= ptt_srpt->title[ttn - 1].nr_of_ptts)
+  {
+    return std::nullopt;
+  }
+  auto const &entry = ptt_srpt->title[ttn - 1].ptt[ptt];
+  if (entry.pgcn < 1 || entry.pgcn > pgcit->nr_of_pgci_srp)
+  {
+    return std::nullopt;
+  }
+  auto const pgc = pgcit->pgci_srp[entry.pgcn - 1].pgc;
+  if (!pgc || !pgc->program_map || !pgc->cell_playback || entry.pgn < 1 || entry.pgn > pgc->nr_of_programs)
+  {
+    return std::nullopt;
+  }
+  auto const first_cell = pgc->program_map[entry.pgn - 1] - 1;
+  if (first_cell < 0 || first_cell >= pgc->nr_of_cells)
+  {
+    return std::nullopt;
+  }
+  return ptt_target{entry.pgcn, entry.pgn, pgc, first_cell};
+}
+
+// As ptt_pgc(), for chapters that have to be there.
+ptt_target chapter_target(ifo_handle_t const &vts, title_info_t const &info, int title, int ptt)
+{
+  if (auto const target = ptt_pgc(vts, info.vts_ttn, ptt))
+  {
+    return *target;
+  }
+  throw libdvdread_exception(std::format("Chapter {} of title {} references a missing program", ptt + 1, title + 1));
+}
+
+title_chapters get_chapters_for_title(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  auto const &vts = vtss.get(info.title_set_nr);
+
+  auto chapters = title_chapters{title + 1, 0, std::pmr::vector<int32_t>(1, 0, vtss.resource())};
+
+  auto overall_frames = 0u;
+  auto fps = 0u; // This should be consistent as DVDs are either NTSC or PAL
+
+  for (auto chapter = 0; chapter < info.nr_of_ptts - 1; chapter++)
+  {
+    auto const start_cell = chapter_target(vts, info, title, chapter).first_cell;
+    auto const next = chapter_target(vts, info, title, chapter + 1);
+    auto const cur_pgc = next.pgc;
+    auto const end_cell = next.first_cell - 1;
+    auto cur_frames = 0u;
+
+    for (auto cur_cell = start_cell; cur_cell <= end_cell && cur_cell < cur_pgc->nr_of_cells; cur_cell++)
+    {
+      auto const cell_frames = dvd_time_to_frames(cur_pgc->cell_playback[cur_cell].playback_time);
+      fps = cell_frames.fps;
+      cur_frames += cell_frames.frames;
+    }
+
+    overall_frames += cur_frames;
+    chapters.starts_ms.push_back(frames_to_timestamp_ms(overall_frames, fps));
+  }
+
+  chapters.fps = fps;
+  return chapters;
+}
+
+// Lists the cells every chapter of a title plays. A chapter runs up to the next
+// one if that is in the same PGC, and to the end of its PGC otherwise.
+title_sectors get_sectors_for_title(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  auto &vts = vtss.get(info.title_set_nr);
+  auto const chapters = get_chapters_for_title(vtss, vmg, title);
+
+  auto sectors = title_sectors{title + 1, info.title_set_nr, std::pmr::vector<chapter_sectors>{vtss.resource()}};
+  for (auto ptt = 0; ptt < info.nr_of_ptts; ++ptt)
+  {
+    auto const target = chapter_target(vts, info, title, ptt);
+    auto const pgc = target.pgc;
+    auto const first_cell = target.first_cell;
+    auto last_cell = pgc->nr_of_cells - 1;
+    if (auto const next = ptt + 1 < info.nr_of_ptts ? ptt_pgc(vts, info.vts_ttn, ptt + 1) : std::nullopt;
+        next && next->pgc == pgc)
+    {
+      last_cell = next->first_cell - 1;
+    }
+
+    auto chapter = chapter_sectors{ptt + 1, target.pgcn, chapters.starts_ms[ptt],
+                                   std::pmr::vector<cell_sectors>{vtss.resource()}};
+    auto angle = 0;
+    for (auto cell = first_cell; cell <= last_cell && cell < pgc->nr_of_cells; ++cell)
+    {
+      auto const &playback = pgc->cell_playback[cell];
+      if (playback.block_type == BLOCK_TYPE_ANGLE_BLOCK)
+      {
+        angle = playback.block_mode == BLOCK_MODE_FIRST_CELL ? 1 : angle + 1;
+      }
+      else
+      {
+        angle = 0;
+      }
+      chapter.cells.push_back(
+          {cell + 1, angle, playback.interleaved != 0, playback.first_sector, playback.last_sector});
+    }
+    sectors.chapters.push_back(std::move(chapter));
+  }
+  return sectors;
+}
+
+// The presentation time span of a VOBU, in 90 kHz ticks.
+struct vobu_ptm
+{
+  uint32_t start;
+  uint32_t end;
+};
+
+// Returns the time span of the VOBU the NAV pack at sector heads, or nothing
+// if block does not hold one.
+std::optional<vobu_ptm> parse_nav_pack(unsigned char *block, uint32_t sector)
+{
+  // A NAV pack is a pack header and a system header, followed by the PCI
+  // packet (private stream 2, substream 0) at a fixed offset.
+  constexpr unsigned char pack_start[] = {0x00, 0x00, 0x01, 0xba};
+  constexpr unsigned char pci_start[] = {0x00, 0x00, 0x01, 0xbf};
+  constexpr auto pci_packet = 0x26;
+  constexpr auto pci_substream = 0x2c;
+  if (!std::equal(std::begin(pack_start), std::end(pack_start), block) ||
+      !std::equal(std::begin(pci_start), std::end(pci_start), block + pci_packet) ||
+      block[pci_substream] != PS2_PCI_SUBSTREAM_ID)
+  {
+    return std::nullopt;
+  }
+  auto pci = pci_t{};
+  ::navRead_PCI(&pci, block + pci_substream + 1);
+  if (pci.pci_gi.nv_pck_lbn != sector || pci.pci_gi.vobu_e_ptm <= pci.pci_gi.vobu_s_ptm)
+  {
+    return std::nullopt;
+  }
+  return vobu_ptm{pci.pci_gi.vobu_s_ptm, pci.pci_gi.vobu_e_ptm};
+}
+
+// Reads the DSI of the NAV pack at sector into block, which holds a sector.
+// Returns nothing if the sector cannot be read or holds no NAV pack.
+std::optional<dsi_t> read_dsi(dvd_file_t *file, uint32_t sector, unsigned char *block)
+{
+  // The DSI packet (private stream 2, substream 1) follows the PCI packet at
+  // a fixed offset as well.
+  constexpr unsigned char dsi_start[] = {0x00, 0x00, 0x01, 0xbf};
+  constexpr auto dsi_packet = 0x400;
+  constexpr auto dsi_substream = 0x406;
+  if (::DVDReadBlocks(file, static_cast<int>(sector), 1, block) != 1 || !parse_nav_pack(block, sector) ||
+      !std::equal(std::begin(dsi_start), std::end(dsi_start), block + dsi_packet) ||
+      block[dsi_substream] != PS2_DSI_SUBSTREAM_ID)
+  {
+    return std::nullopt;
+  }
+  auto dsi = dsi_t{};
+  ::navRead_DSI(&dsi, block + dsi_substream + 1);
+  if (dsi.dsi_gi.nv_pck_lbn != sector)
+  {
+    return std::nullopt;
+  }
+  return dsi;
+}
+
+// Reads the NAV packs at the given ascending sectors, coalescing adjacent ones
+// into a single read. Sectors that cannot be read are left empty.
+std::pmr::vector<std::optional<vobu_ptm>> read_nav_packs(dvd_file_t *file, std::pmr::vector<uint32_t> const &sectors)
+{
+  constexpr size_t max_blocks_per_read = 16;
+  auto const buffer = alloc_blocks(max_blocks_per_read);
+  auto ptms = std::pmr::vector<std::optional<vobu_ptm>>(sectors.size(), sectors.get_allocator());
+  for (size_t i = 0; i < sectors.size();)
+  {
+    auto count = size_t{1};
+    while (count < max_blocks_per_read && i + count < sectors.size() && sectors[i + count] == sectors[i] + count)
+    {
+      ++count;
+    }
+    if (::DVDReadBlocks(file, static_cast<int>(sectors[i]), count, buffer.get()) == static_cast<ssize_t>(count))
+    {
+      for (size_t j = 0; j < count; ++j)
+      {
+        ptms[i + j] = parse_nav_pack(buffer.get() + j * DVD_VIDEO_LB_LEN, sectors[i + j]);
+      }
+    }
+    i += count;
+  }
+  return ptms;
+}
+
+// Chapter start times from the NAV packs heading the first and the last VOBU
+// of every cell, whose presentation times give the exact length of the cell.
+// Those are the only sectors read, in ascending order. Cells whose NAV packs
+// cannot be made sense of count with their playback time from the IFO.
+title_chapters get_nav_chapters_for_title(vts_cache &vtss, ifo_handle_t &vmg, dvd_reader_t &dvd, int title)
+{
+  auto const sectors = get_sectors_for_title(vtss, vmg, title);
+  auto const &vts = vtss.get(sectors.title_set);
+  auto const playback = [&](chapter_sectors const &chapter, cell_sectors const &cell) -> cell_playback_t const & {
+    return vts.vts_pgcit->pgci_srp[chapter.pgc - 1].pgc->cell_playback[cell.cell - 1];
+  };
+
+  auto nav_sectors = std::pmr::vector<uint32_t>{vtss.resource()};
+  for (auto const &chapter : sectors.chapters)
+  {
+    for (auto const &cell : chapter.cells)
+    {
+      nav_sectors.push_back(cell.first_sector);
+      nav_sectors.push_back(playback(chapter, cell).last_vobu_start_sector);
+    }
+  }
+  std::sort(nav_sectors.begin(), nav_sectors.end());
+  nav_sectors.erase(std::unique(nav_sectors.begin(), nav_sectors.end()), nav_sectors.end());
+  auto const ptms = read_nav_packs(dvd_file_open(dvd, sectors.title_set).get(), nav_sectors);
+  auto const ptm_at = [&](uint32_t sector) {
+    return ptms[std::lower_bound(nav_sectors.begin(), nav_sectors.end(), sector) - nav_sectors.begin()];
+  };
+
+  auto chapters = title_chapters{title + 1, 0, std::pmr::vector<int32_t>{vtss.resource()}};
+  auto ticks = uint64_t{0};
+  for (auto const &chapter : sectors.chapters)
+  {
+    chapters.starts_ms.push_back(static_cast<int32_t>((ticks + 45) / 90));
+    for (auto const &cell : chapter.cells)
+    {
+      auto const &pb = playback(chapter, cell);
+      auto const frames = dvd_time_to_frames(pb.playback_time);
+      chapters.fps = frames.fps;
+      if (cell.angle > 1)
+      {
+        continue;
+      }
+      auto const first = ptm_at(cell.first_sector);
+      auto const last = ptm_at(pb.last_vobu_start_sector);
+      if (first && last && last->end > first->start)
+      {
+        ticks += last->end - first->start;
+      }
+      else
+      {
+        ticks += uint64_t{frames.frames} * (frames.fps == 30 ? 3003 : 3600);
+      }
+    }
+  }
+  return chapters;
+}
+
+// CRC-64/XZ : the ECMA-182 polynomial, reflected.
+struct crc64
+{
+  void update(unsigned char const *data, size_t size)
+  {
+    for (size_t i = 0; i < size; ++i)
+    {
+      crc_ = table[(crc_ ^ data[i]) & 0xff] ^ (crc_ >> 8);
+    }
+  }
+
+  void update(uint64_t value)
+  {
+    unsigned char bytes[8];
+    for (auto &byte : bytes)
+    {
+      byte = static_cast<unsigned char>(value);
+      value >>= 8;
+    }
+    update(bytes, sizeof bytes);
+  }
+
+  uint64_t value() const
+  {
+    return ~crc_;
+  }
+
+private:
+  static constexpr auto table = [] {
+    auto table = std::array<uint64_t, 256>{};
+    for (auto i = 0u; i < table.size(); ++i)
+    {
+      auto crc = uint64_t{i};
+      for (auto bit = 0; bit < 8; ++bit)
+      {
+        crc = crc & 1 ? (crc >> 1) ^ 0xc96c5795d7870f42 : crc >> 1;
+      }
+      table[i] = crc;
+    }
+    return table;
+  }();
+
+  uint64_t crc_ = ~uint64_t{0};
+};
+
+// Hashes the sizes of the IFO and the VOBs of every title set, in title set
+// order, and the contents of the IFOs. libdvdread does not hand out the IFO
+// data it parsed, so those are read once more, which the page cache serves
+// right after ifoOpen() went through them.
+std::string crc64_fingerprint(dvd_reader_t &dvd, ifo_handle_t const &vmg)
+{
+  constexpr size_t blocks_per_read = 16;
+  auto const buffer = alloc_blocks(blocks_per_read);
+  auto crc = crc64{};
+  auto const add_size = [&](int title_set, dvd_read_domain_t domain) {
+    auto stat = dvd_stat_t{};
+    crc.update(::DVDFileStat(&dvd, title_set, domain, &stat) == 0 ? static_cast<uint64_t>(stat.size) : 0);
+  };
+
+  for (auto title_set = 0; title_set <= vmg.vmgi_mat->vmg_nr_of_title_sets; ++title_set)
+  {
+    add_size(title_set, DVD_READ_INFO_FILE);
+    add_size(title_set, DVD_READ_MENU_VOBS);
+    if (title_set > 0)
+    {
+      add_size(title_set, DVD_READ_TITLE_VOBS);
+    }
+
+    auto const file = dvd_file_open(dvd, title_set, DVD_READ_INFO_FILE);
+    auto const blocks = ::DVDFileSize(file.get());
+    if (blocks < 0)
+    {
+      throw libdvdread_exception(std::format("Failed to get the size of the IFO of title set {}", title_set));
+    }
+    for (auto left = static_cast<size_t>(blocks); left > 0;)
+    {
+      auto const size = std::min(left, blocks_per_read) * DVD_VIDEO_LB_LEN;
+      if (::DVDReadBytes(file.get(), buffer.get(), size) != static_cast<ssize_t>(size))
+      {
+        throw libdvdread_exception(std::format("Failed to read the IFO of title set {}", title_set));
+      }
+      crc.update(buffer.get(), size);
+      left -= size / DVD_VIDEO_LB_LEN;
+    }
+  }
+  return std::format("crc64:{:016x}", crc.value());
+}
+
+std::string disc_id_fingerprint(dvd_reader_t &dvd)
+{
+  unsigned char id[16];
+  if (::DVDDiscID(&dvd, id) != 0)
+  {
+    throw libdvdread_exception("Failed to compute the disc ID");
+  }
+  auto fingerprint = std::string{"md5:"};
+  for (auto byte : id)
+  {
+    std::format_to(std::back_inserter(fingerprint), "{:02x}", byte);
+  }
+  return fingerprint;
+}
+
+// Hashes the angle and chapter counts of a title, the program every chapter
+// starts at, and the length and block layout of the cells of the PGCs it
+// plays, but nothing about where the cells lie in the VOBs.
+uint64_t get_title_signature(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  auto const &vts = vtss.get(info.title_set_nr);
+  auto crc = crc64{};
+  crc.update(info.nr_of_angles);
+  crc.update(info.nr_of_ptts);
+  pgc_t const *previous = nullptr;
+  for (auto ptt = 0; ptt < info.nr_of_ptts; ++ptt)
+  {
+    auto const target = ptt_pgc(vts, info.vts_ttn, ptt);
+    if (!target)
+    {
+      crc.update(~uint64_t{0});
+      continue;
+    }
+    auto const pgc = target->pgc;
+    crc.update(target->pgn);
+    if (pgc != previous)
+    {
+      crc.update(pgc->nr_of_cells);
+      for (auto cell = 0; cell < pgc->nr_of_cells; ++cell)
+      {
+        auto const &playback = pgc->cell_playback[cell];
+        auto const frames = dvd_time_to_frames(playback.playback_time);
+        crc.update(uint64_t{frames.frames} << 16 | frames.fps << 4 | playback.block_type << 2 | playback.block_mode);
+      }
+      previous = pgc;
+    }
+  }
+  return crc.value();
+}
+
+enum decoy_flags : unsigned
+{
+  decoy_bad_reference = 1u << 0,
+  decoy_bad_cell_range = 1u << 1,
+  decoy_zero_length_cell = 1u << 2,
+  decoy_overlapping_cells = 1u << 3,
+  decoy_pgc_loop = 1u << 4,
+  decoy_ptt_loop = 1u << 5,
+};
+
+std::string decoy_flags_to_string(unsigned flags)
+{
+  static constexpr std::pair<unsigned, std::string_view> names[] = {
+      {decoy_bad_reference, "invalid PTT/PGC reference"},
+      {decoy_bad_cell_range, "absurd chapter cell range"},
+      {decoy_zero_length_cell, "mostly zero-length cells"},
+      {decoy_overlapping_cells, "overlapping cells"},
+      {decoy_pgc_loop, "looping PGC chain"},
+      {decoy_ptt_loop, "chapters looping back"},
+  };
+  auto str = std::string{};
+  for (auto &&[flag, name] : names)
+  {
+    if (flags & flag)
+    {
+      str += str.empty() ? "" : ", ";
+      str += name;
+    }
+  }
+  return str;
+}
+
+unsigned analyze_pgc(pgc_t const &pgc, std::pmr::memory_resource *mr)
+{
+  auto flags = 0u;
+  if (pgc.nr_of_programs == 0 || !pgc.program_map || pgc.nr_of_cells == 0 || !pgc.cell_playback)
+  {
+    return decoy_bad_reference;
+  }
+  for (auto p = 0; p < pgc.nr_of_programs; ++p)
+  {
+    if (pgc.program_map[p] < 1 || pgc.program_map[p] > pgc.nr_of_cells)
+    {
+      flags |= decoy_bad_cell_range;
+    }
+  }
+
+  // Cells of an angle block are interleaved and legitimately share sectors,
+  // every other cell must occupy its own range. Zero-length cells which carry
+  // a cell command are found on real discs too, only a PGC made up of mostly
+  // empty cells doing nothing is suspicious.
+  auto ranges = std::pmr::vector<std::pair<uint32_t, uint32_t>>{mr};
+  auto num_empty_cells = 0;
+  for (auto c = 0; c < pgc.nr_of_cells; ++c)
+  {
+    auto const &cell = pgc.cell_playback[c];
+    if (cell.still_time == 0 && cell.cell_cmd_nr == 0 && dvd_time_to_frames(cell.playback_time).frames == 0)
+    {
+      ++num_empty_cells;
+    }
+    if (cell.first_sector > cell.last_sector)
+    {
+      flags |= decoy_bad_cell_range;
+    }
+    else if (cell.block_type == 0)
+    {
+      ranges.emplace_back(cell.first_sector, cell.last_sector);
+    }
+  }
+  if (num_empty_cells * 2 >= pgc.nr_of_cells)
+  {
+    flags |= decoy_zero_length_cell;
+  }
+  std::sort(ranges.begin(), ranges.end());
+  for (auto i = size_t{1}; i < ranges.size(); ++i)
+  {
+    if (ranges[i].first <= ranges[i - 1].second)
+    {
+      flags |= decoy_overlapping_cells;
+      break;
+    }
+  }
+  return flags;
+}
+
+// Inspects the PTT table, cell chains and PGC links of a title for the kind of
+// damage structure protection schemes put into the titles nobody is supposed
+// to play. Returns a combination of decoy_flags, 0 for a title that looks sane.
+unsigned analyze_title(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  if (info.title_set_nr < 1 || info.title_set_nr > vmg.vmgi_mat->vmg_nr_of_title_sets)
+  {
+    return decoy_bad_reference;
+  }
+  auto &vts = vtss.get(info.title_set_nr);
+
+  auto flags = 0u;
+  auto analyzed = std::pmr::vector<pgc_t const *>{vtss.resource()};
+  for (auto ptt = 0; ptt < info.nr_of_ptts; ++ptt)
+  {
+    auto const target = ptt_pgc(vts, info.vts_ttn, ptt);
+    if (!target)
+    {
+      return flags | decoy_bad_reference;
+    }
+    if (std::find(analyzed.begin(), analyzed.end(), target->pgc) == analyzed.end())
+    {
+      flags |= analyze_pgc(*target->pgc, vtss.resource());
+      analyzed.push_back(target->pgc);
+    }
+    // The previous chapter runs from its first cell up to the cell before
+    // this chapter if both are in the same PGC, else to the end of its own
+    // PGC, as in multi-PGC "play all" titles. Its first cell was checked when
+    // looking it up.
+    if (auto const prev = ptt_pgc(vts, info.vts_ttn, ptt - 1); prev && prev->pgc == target->pgc)
+    {
+      if (target->pgn <= prev->pgn)
+      {
+        flags |= decoy_ptt_loop;
+      }
+      else if (prev->first_cell > target->first_cell)
+      {
+        flags |= decoy_bad_cell_range;
+      }
+    }
+  }
+
+  if (info.nr_of_ptts > 0)
+  {
+    auto const num_pgcs = vts.vts_pgcit->nr_of_pgci_srp;
+    auto visited = std::pmr::vector<bool>(num_pgcs + 1, false, vtss.resource());
+    for (auto pgcn = vts.vts_ptt_srpt->title[info.vts_ttn - 1].ptt[0].pgcn; pgcn >= 1 && pgcn <= num_pgcs;
+         pgcn = vts.vts_pgcit->pgci_srp[pgcn - 1].pgc->next_pgc_nr)
+    {
+      if (visited[pgcn])
+      {
+        flags |= decoy_pgc_loop;
+        break;
+      }
+      visited[pgcn] = true;
+    }
+  }
+  return flags;
+}
+
+std::vector<bool> find_decoy_titles(vts_cache &vtss, ifo_handle_t &vmg, std::ostream &report)
+{
+  auto const num_titles = vmg.tt_srpt->nr_of_srpts;
+  auto decoys = std::vector<bool>(num_titles);
+  auto num_decoys = 0;
+  for (auto t = 0; t < num_titles; ++t)
+  {
+    auto flags = 0u;
+    try
+    {
+      flags = analyze_title(vtss, vmg, t);
+    }
+    catch (libdvdread_exception const &)
+    {
+      flags = decoy_bad_reference;
+    }
+    if (flags != 0u)
+    {
+      decoys[t] = true;
+      ++num_decoys;
+      report << std::format("Skipping title {} : {}\n", t + 1, decoy_flags_to_string(flags));
+    }
+  }
+  if (num_decoys > 0)
+  {
+    report << std::format("Skipped {} of {} titles as likely decoys.\n", num_decoys, num_titles);
+  }
+  return decoys;
+}
+
+// Sums the playback_time of the PGCs a title plays, one BCD decode per PGC
+// instead of one per cell. Every PGC counts once, however often the chapters
+// return to it, so that chapters jumping back and forth between PGCs cannot
+// inflate a decoy's duration. Returns zero frames if the title references
+// PGCs that do not exist.
+frame_count title_duration(ifo_handle_t const &vts, title_info_t const &info)
+{
+  auto duration = frame_count{0, 0};
+  auto counted = std::vector<pgc_t const *>{};
+  for (auto ptt = 0; ptt < info.nr_of_ptts; ++ptt)
+  {
+    auto const target = ptt_pgc(vts, info.vts_ttn, ptt);
+    if (!target)
+    {
+      return {0, 0};
+    }
+    auto const pgc = target->pgc;
+    if (std::find(counted.begin(), counted.end(), pgc) == counted.end())
+    {
+      auto const pgc_frames = dvd_time_to_frames(pgc->playback_time);
+      duration.frames += pgc_frames.frames;
+      duration.fps = pgc_frames.fps;
+      counted.push_back(pgc);
+    }
+  }
+  return duration;
+}
+
+bool title_set_valid(ifo_handle_t const &vmg, title_info_t const &info)
+{
+  return info.title_set_nr >= 1 && info.title_set_nr <= vmg.vmgi_mat->vmg_nr_of_title_sets;
+}
+
+struct title_rank
+{
+  int title;
+  frame_count duration;
+  uint16_t nr_of_ptts;
+  uint8_t nr_of_angles;
+};
+
+// Picks the main feature using only the title table and the playback_time of
+// each PGC a title plays, i.e. without walking any cells. The longest title
+// wins, ties go to the one with more chapters, then fewer angles, then the
+// lowest title number. Titles flagged in skip are not considered, nor are
+// titles whose VTS IFO cannot be read. Returns -1 if the disc has no usable
+// title.
+int find_main_title(vts_cache &vtss, ifo_handle_t &vmg, std::vector<bool> const &skip)
+{
+  auto best = title_rank{-1, {0, 0}, 0, 0};
+  for (auto t = 0; t < vmg.tt_srpt->nr_of_srpts; ++t)
+  {
+    auto const &info = vmg.tt_srpt->title[t];
+    if (skip[t] || info.nr_of_ptts == 0 || !title_set_valid(vmg, info))
+    {
+      continue;
+    }
+
+    auto rank = title_rank{t, {0, 0}, info.nr_of_ptts, info.nr_of_angles};
+    try
+    {
+      rank.duration = title_duration(vtss.get(info.title_set_nr), info);
+    }
+    catch (libdvdread_exception const &)
+    {
+      continue;
+    }
+    auto const duration = frames_to_timestamp_ms(rank.duration.frames, rank.duration.fps);
+    auto const best_duration = frames_to_timestamp_ms(best.duration.frames, best.duration.fps);
+    if (best.title < 0 || duration > best_duration ||
+        (duration == best_duration &&
+         (rank.nr_of_ptts > best.nr_of_ptts ||
+          (rank.nr_of_ptts == best.nr_of_ptts && rank.nr_of_angles < best.nr_of_angles))))
+    {
+      best = rank;
+    }
+  }
+  return best.title;
+}
+
+title_summary summarize_title(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  auto const duration =
+      title_set_valid(vmg, info) ? title_duration(vtss.get(info.title_set_nr), info) : frame_count{0, 0};
+  return {title + 1,
+          info.title_set_nr,
+          info.nr_of_ptts,
+          info.nr_of_angles,
+          frames_to_timestamp_ms(duration.frames, duration.fps),
+          duration.fps};
+}
+
+// The first letter of the code is in the high byte.
+std::array<char, 3> language_code(bool present, uint16_t code)
+{
+  auto const first = static_cast<char>(code >> 8);
+  auto const second = static_cast<char>(code & 0xff);
+  if (!present || first < 'a' || first > 'z' || second < 'a' || second > 'z')
+  {
+    return {};
+  }
+  return {first, second, '\0'};
+}
+
+title_streams get_streams_for_title(vts_cache &vtss, ifo_handle_t &vmg, int title)
+{
+  auto const &info = vmg.tt_srpt->title[title];
+  auto const &vts = vtss.get(info.title_set_nr);
+  auto const &mat = *vts.vtsi_mat;
+  auto const target = ptt_pgc(vts, info.vts_ttn, 0);
+  auto const pgc = target ? target->pgc : nullptr;
+
+  auto const &video = mat.vts_video_attr;
+  auto const pal = video.video_format == 1;
+  constexpr unsigned widths[] = {720, 704, 352, 352};
+  auto streams = title_streams{title + 1,
+                               info.title_set_nr,
+                               {pal ? "PAL" : "NTSC", video.display_aspect_ratio == 3 ? "16:9" : "4:3",
+                                widths[video.picture_size],
+                                video.picture_size == 3 ? (pal ? 288u : 240u) : (pal ? 576u : 480u),
+                                video.letterboxed != 0},
+                               std::pmr::vector<audio_stream>{vtss.resource()},
+                               std::pmr::vector<subpicture_stream>{vtss.resource()}};
+
+  constexpr std::string_view audio_formats[] = {"ac3", "", "mpeg1", "mpeg2ext", "lpcm", "", "dts", "sdds"};
+  constexpr int audio_ids[] = {0x80, 0, 0xc0, 0xc0, 0xa0, 0, 0x88, 0};
+  for (auto i = 0; i < std::min<int>(mat.nr_of_vts_audio_streams, 8); ++i)
+  {
+    // Without a PGC to go by, every stream of the title set is listed.
+    auto const control = pgc ? pgc->audio_control[i] : 0x8000 | i << 8;
+    if (!(control & 0x8000))
+    {
+      continue;
+    }
+    auto const &attr = mat.vts_audio_attr[i];
+    auto const id = audio_ids[attr.audio_format];
+    streams.audio.push_back({i, id ? id + ((control >> 8) & 0x07) : 0, audio_formats[attr.audio_format],
+                             language_code(attr.lang_type == 1, attr.lang_code),
+                             attr.channels + 1u, attr.sample_frequency == 1 ? 96000u : 48000u});
+  }
+  for (auto i = 0; i < std::min<int>(mat.nr_of_vts_subp_streams, 32); ++i)
+  {
+    auto const control = pgc ? pgc->subp_control[i] : 0x80000000u | i << 24 | i << 16;
+    if (!(control & 0x80000000u))
+    {
+      continue;
+    }
+    // Widescreen titles carry their subpictures in the wide variant.
+    auto const number = (control >> (video.display_aspect_ratio == 3 ? 16 : 24)) & 0x1f;
+    auto const &attr = mat.vts_subp_attr[i];
+    streams.subpictures.push_back(
+        {i, static_cast<int>(0x20 + number), language_code(attr.type == 1, attr.lang_code)});
+  }
+  return streams;
+}
+
+} // namespace
+
+libdvdread_logger::libdvdread_logger(std::pmr::memory_resource *mr) : messages_(mr)
+{
+  this->pf_log = pf_log_;
+}
+
+libdvdread_logger::~libdvdread_logger()
+{
+  if (do_report_messages_ && !messages_.empty())
+  {
+    std::cerr << "Messages reported by libdvdread :\n" << messages();
+  }
+}
+
+std::string libdvdread_logger::messages() const
+{
+  auto str = std::string{};
+  for (auto &&msg : messages_)
+  {
+    std::format_to(std::back_inserter(str), "[{}] {}\n", lvl_to_str(msg.first), msg.second);
+  }
+  return str;
+}
+
+void libdvdread_logger::pf_log_(void *p, dvd_logger_level_t lvl, char const *fmt, va_list args)
+{
+  char msg[16 * 1024];
+  auto const num_written = ::vsnprintf(msg, sizeof(msg), fmt, args);
+  if (num_written >= 0)
+  {
+    auto const sv_length =
+        static_cast<std::string_view::size_type>(std::min(num_written, static_cast<int>(sizeof(msg) - 1)));
+    static_cast<libdvdread_logger *>(p)->messages_.emplace_back(lvl, std::string_view{msg, sv_length});
+  }
+}
+
+unique_fd open_file(char const *path, int flags)
+{
+  auto fd = unique_fd{::open(path, flags | O_CLOEXEC, 0666)};
+  if (fd.get() < 0)
+  {
+    throw stream_exception(std::format("Failed to open {} : {}", path, std::strerror(errno)));
+  }
+  return fd;
+}
+
+
+std::unique_ptr<dvd_stream> make_stream(char const *path, std::optional<deadline_clock::time_point> deadline,
+                                        bool direct_io)
+{
+  auto stream = std::unique_ptr<dvd_stream>{};
+  struct stat st;
+  if (path == std::string_view{"-"})
+  {
+    stream = std::make_unique<pipe_stream>(unique_fd{::dup(STDIN_FILENO)});
+  }
+  else if (std::string_view{path}.starts_with("http://") || std::string_view{path}.starts_with("https://"))
+  {
+    stream = std::make_unique<http_stream>(path);
+  }
+  else if (std::string_view{path}.ends_with(".zst"))
+  {
+    stream = std::make_unique<zstd_seekable_stream>(path);
+  }
+  else if (::stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+  {
+    stream = std::make_unique<pipe_stream>(open_file(path));
+  }
+  else if ((direct_io || deadline) && ::stat(path, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+  {
+    stream = direct_io ? std::unique_ptr<dvd_stream>{std::make_unique<direct_stream>(path)}
+                       : std::make_unique<file_stream>(path);
+  }
+
+  if (stream && deadline)
+  {
+    stream = std::make_unique<deadline_stream>(std::move(stream), *deadline);
+  }
+  return stream;
+}
+
+void prefetch_ifos(char const *path)
+{
+  struct stat st;
+  if (std::string_view{path}.ends_with(".zst") || ::stat(path, &st) != 0 ||
+      !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+  {
+    return;
+  }
+  auto logger = libdvdread_logger{};
+  logger.disable_report();
+  auto const dvd = dvd_uptr{::DVDOpen2(&logger, &logger, path), &::DVDClose};
+  if (dvd)
+  {
+    advise_ifos(*dvd, path);
+  }
+}
+
+trace_recorder &trace_recorder::instance()
+{
+  static auto recorder = trace_recorder{};
+  return recorder;
+}
+
+void trace_recorder::open(char const *path, bool create)
+{
+  fd_.emplace(open_file(path, O_WRONLY | O_APPEND | (create ? O_CREAT | O_TRUNC : 0)));
+  if (create)
+  {
+    write_all("[\n");
+  }
+  pid_ = ::getpid();
+}
+
+void trace_recorder::set_thread_name(std::string name)
+{
+  buffer().name = std::move(name);
+}
+
+void trace_recorder::set_disc(std::string_view disc)
+{
+  buffer().discs.push_back(json_escape(disc));
+}
+
+void trace_recorder::record(char const *name, int64_t start_us, int64_t end_us, char const *arg_name, int arg)
+{
+  auto &buf = buffer();
+  buf.events.push_back({name, start_us, end_us - start_us, buf.discs.size() - 1, arg_name, arg});
+}
+
+void trace_recorder::finish(bool last)
+{
+  if (!fd_)
+  {
+    return;
+  }
+  auto out = std::string{};
+  auto separator = std::string_view{};
+  for (auto const &buf : buffers_)
+  {
+    auto const name = buf->name.empty() ? std::format("thread {}", buf->tid) : buf->name;
+    out += std::format(R"({}{{"name":"thread_name","ph":"M","pid":{},"tid":{},"args":{{"name":"{}"}}}})", separator,
+                       pid_, buf->tid, json_escape(name));
+    separator = ",\n";
+    for (auto const &ev : buf->events)
+    {
+      out += std::format(R"({}{{"name":"{}","ph":"X","ts":{},"dur":{},"pid":{},"tid":{},"args":{{"disc":"{}")",
+                         separator, ev.name, ev.start_us, ev.duration_us, pid_, buf->tid, buf->discs[ev.disc]);
+      out += ev.arg_name ? std::format(R"(,"{}":{}}}}})", ev.arg_name, ev.arg) : std::string{"}}"};
+    }
+  }
+  out += last ? "\n]\n" : separator;
+  write_all(out);
+  fd_.reset();
+}
+
+trace_recorder::thread_buffer &trace_recorder::buffer()
+{
+  thread_local thread_buffer *buf = nullptr;
+  if (!buf)
+  {
+    auto const lock = std::lock_guard{mutex_};
+    buf = buffers_.emplace_back(std::make_unique<thread_buffer>(static_cast<unsigned>(buffers_.size()))).get();
+  }
+  return *buf;
+}
+
+void trace_recorder::write_all(std::string_view data)
+{
+  if (::write(fd_->get(), data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+  {
+    throw stream_exception(std::format("Failed writing trace : {}", std::strerror(errno)));
+  }
+}
+
+void add_counts(perf_values &total, perf_values const &delta)
+{
+  for (auto c = size_t{0}; c < num_perf_counters; ++c)
+  {
+    if (delta[c])
+    {
+      total[c] = total[c].value_or(0) + *delta[c];
+    }
+  }
+}
+
+perf_values diff_counts(perf_values const &after, perf_values const &before)
+{
+  auto delta = perf_values{};
+  for (auto c = size_t{0}; c < num_perf_counters; ++c)
+  {
+    if (after[c] && before[c])
+    {
+      delta[c] = *after[c] - *before[c];
+    }
+  }
+  return delta;
+}
+
+perf_profiler &perf_profiler::instance()
+{
+  static auto profiler = perf_profiler{};
+  return profiler;
+}
+
+perf_values perf_profiler::read_thread() const
+{
+  return perf_sampler::thread_instance().read();
+}
+
+void perf_profiler::begin_disc()
+{
+  if (enabled_)
+  {
+    auto &state = thread_perf_disc();
+    state = {};
+    state.active = true;
+    state.last = perf_sampler::thread_instance().read();
+  }
+}
+
+perf_phases perf_profiler::end_disc()
+{
+  if (!enabled_)
+  {
+    return {};
+  }
+  auto &state = thread_perf_disc();
+  charge(state);
+  state.active = false;
+  return state.counts;
+}
+
+std::optional<std::optional<perf_phase>> perf_profiler::enter(perf_phase phase)
+{
+  if (!enabled_ || !thread_perf_disc().active)
+  {
+    return std::nullopt;
+  }
+  auto &state = thread_perf_disc();
+  charge(state);
+  return std::exchange(state.current, phase);
+}
+
+void perf_profiler::leave(std::optional<perf_phase> previous)
+{
+  auto &state = thread_perf_disc();
+  charge(state);
+  state.current = previous;
+}
+
+ifo_handle_t &vts_cache::get(int title_set)
+{
+  if (static_cast<size_t>(title_set) >= handles_.size())
+  {
+    handles_.resize(title_set + 1);
+  }
+  auto &handle = handles_[title_set];
+  if (!handle)
+  {
+    handle.emplace(ifo_open(dvd_, title_set));
+  }
+  return **handle;
+}
+
+disc::disc(char const *path, dvd_stream *stream, libdvdread_logger &logger, std::pmr::memory_resource *mr)
+    : stream_context_(stream ? std::make_unique<stream_context>(*stream, logger) : nullptr),
+      dvd_(dvd_open(path, stream_context_.get(), logger)), vmg_(ifo_open(*dvd_, 0)), vtss_(*dvd_, mr)
+{
+  // Titles refer to title sets in any order, while a pipe cannot go back to
+  // the IFO of a title set laid out before one already read.
+  if (stream && stream->forward_only())
+  {
+    for (auto title_set = 1; title_set <= vmg_->vmgi_mat->vmg_nr_of_title_sets; ++title_set)
+    {
+      try
+      {
+        vtss_.get(title_set);
+      }
+      catch (libdvdread_exception const &)
+      {
+        // Left to be reported by the titles using the title set.
+      }
+    }
+  }
+}
+
+disc::~disc() = default;
+
+int disc::num_titles() const
+{
+  return vmg_->tt_srpt->nr_of_srpts;
+}
+
+title_chapters disc::chapters(int title, chapter_times times)
+{
+  check_title(title);
+  if (times == chapter_times::nav_packs)
+  {
+    check_seekable("Taking chapter times from the NAV packs");
+    return get_nav_chapters_for_title(vtss_, *vmg_, *dvd_, title);
+  }
+  return get_chapters_for_title(vtss_, *vmg_, title);
+}
+
+title_summary disc::summary(int title)
+{
+  check_title(title);
+  return summarize_title(vtss_, *vmg_, title);
+}
+
+title_sectors disc::sectors(int title)
+{
+  check_title(title);
+  return get_sectors_for_title(vtss_, *vmg_, title);
+}
+
+std::string disc::fingerprint(fingerprint_kind kind)
+{
+  auto const perf = perf_scope{perf_parse};
+  if (kind == fingerprint_kind::disc_id)
+  {
+    return disc_id_fingerprint(*dvd_);
+  }
+  return crc64_fingerprint(*dvd_, *vmg_);
+}
+
+title_streams disc::streams(int title)
+{
+  check_title(title);
+  return get_streams_for_title(vtss_, *vmg_, title);
+}
+
+uint64_t disc::title_signature(int title)
+{
+  check_title(title);
+  return get_title_signature(vtss_, *vmg_, title);
+}
+
+void disc::copy_title_vobs(int title, std::ostream &out)
+{
+  check_seekable("Copying the VOB data");
+  // 1 MiB per read.
+  constexpr size_t blocks_per_read = 512;
+  auto const sectors = this->sectors(title);
+  auto const file = dvd_file_open(*dvd_, sectors.title_set);
+  auto const buffer = alloc_blocks(blocks_per_read);
+
+  auto const copy = [&](uint64_t first, uint64_t last) {
+    for (auto sector = first; sector <= last;)
+    {
+      auto const count = std::min<uint64_t>(blocks_per_read, last - sector + 1);
+      if (::DVDReadBlocks(file.get(), static_cast<int>(sector), count, buffer.get()) != static_cast<ssize_t>(count))
+      {
+        throw libdvdread_exception(std::format("Failed to read sectors {} to {} of title set {}", sector,
+                                               sector + count - 1, sectors.title_set));
+      }
+      out.write(reinterpret_cast<char const *>(buffer.get()), static_cast<std::streamsize>(count * DVD_VIDEO_LB_LEN));
+      if (!out)
+      {
+        throw stream_exception("Failed writing VOB data");
+      }
+      sector += count;
+    }
+  };
+
+  for (auto const &chapter : sectors.chapters)
+  {
+    for (auto const &cell : chapter.cells)
+    {
+      if (cell.angle > 1)
+      {
+        continue;
+      }
+      if (!cell.interleaved)
+      {
+        copy(cell.first_sector, cell.last_sector);
+        continue;
+      }
+
+      // The DSI of every NAV pack gives the end of its VOBU and where the
+      // next VOBU of the same angle or branch starts, past the ILVUs of the
+      // others.
+      for (auto vobu = uint64_t{cell.first_sector};;)
+      {
+        auto const dsi = read_dsi(file.get(), static_cast<uint32_t>(vobu), buffer.get());
+        auto const vobu_end = vobu + (dsi ? dsi->dsi_gi.vobu_ea : 0);
+        if (!dsi || vobu_end > cell.last_sector)
+        {
+          throw disc_exception(std::format("Broken ILVU chain at sector {} of cell {} in title set {}", vobu,
+                                           cell.cell, sectors.title_set));
+        }
+        copy(vobu, vobu_end);
+        auto const next_vobu = dsi->vobu_sri.next_vobu & SRI_END_OF_CELL;
+        if (next_vobu == SRI_END_OF_CELL)
+        {
+          break;
+        }
+        if (vobu + next_vobu <= vobu_end)
+        {
+          throw disc_exception(std::format("Broken ILVU chain at sector {} of cell {} in title set {}", vobu,
+                                           cell.cell, sectors.title_set));
+        }
+        vobu += next_vobu;
+      }
+    }
+  }
+}
+
+std::vector<bool> disc::find_decoy_titles(std::ostream &report)
+{
+  return ifo2mkv::find_decoy_titles(vtss_, *vmg_, report);
+}
+
+int disc::find_main_title(std::vector<bool> const &skip)
+{
+  return ifo2mkv::find_main_title(vtss_, *vmg_, skip);
+}
+
+void disc::check_title(int title) const
+{
+  if (title < 0 || title >= num_titles())
+  {
+    throw no_such_title_exception(std::format("Title {} requested, but DVD has {} titles.", title + 1, num_titles()));
+  }
+}
+
+void disc::check_seekable(std::string_view what) const
+{
+  if (stream_context_ && stream_context_->stream.forward_only())
+  {
+    throw disc_exception(std::format("{} is not possible for a disc read from a pipe.", what));
+  }
+}
+
+std::string json_escape(std::string_view str)
+{
+  auto escaped = std::string{};
+  escaped.reserve(str.size());
+  append_json_escaped(escaped, str);
+  return escaped;
+}
+
+matroska_chapter_xml_writer::matroska_chapter_xml_writer(std::ostream &stream, std::string_view fingerprint)
+    : rnd_gen_(std::random_device{}()), stream_(stream)
+{
+  stream_ << R"(<?xml version="1.0"?>
+<!-- <!DOCTYPE Chapters SYSTEM "matroskachapters.dtd"> -->
+)";
+  if (!fingerprint.empty())
+  {
+    stream_ << "<!-- Disc fingerprint " << fingerprint << " -->\n";
+  }
+  stream_ << "<Chapters>\n";
+}
+
+matroska_chapter_xml_writer::~matroska_chapter_xml_writer()
+{
+  stream_ << "</Chapters>\n";
+}
+
+void matroska_chapter_xml_writer::on_title_chapters(title_chapters const &chapters)
+{
+  // Formatted straight into the stream, without a temporary string per line.
+  auto const out = std::ostreambuf_iterator<char>{stream_};
+  std::format_to(out, R"(  <EditionEntry>
+    <EditionFlagHidden>0</EditionFlagHidden>
+    <EditionFlagDefault>0</EditionFlagDefault>
+    <EditionFlagOrdered>0</EditionFlagOrdered>
+    <EditionUID>{}</EditionUID>
+)",
+                 rnd_gen_());
+  auto chapter_num = 1u;
+  for (auto timestamp_ms : chapters.starts_ms)
+  {
+    std::format_to(out, R"(    <ChapterAtom>
+      <ChapterUID>{}</ChapterUID>
+      <ChapterTimeStart>{}</ChapterTimeStart>
+      <ChapterDisplay>
+        <ChapterString>Chapter {:02}</ChapterString>
+        <ChapterLanguage>und</ChapterLanguage>
+        <ChapLanguageIETF>und</ChapLanguageIETF>
+      </ChapterDisplay>
+    </ChapterAtom>
+)",
+                   rnd_gen_(), format_timestamp(timestamp_ms), chapter_num++);
+  }
+  stream_ << "  </EditionEntry>\n";
+}
+
+summary_table_writer::summary_table_writer(std::ostream &stream, std::string_view fingerprint) : stream_(stream)
+{
+  if (!fingerprint.empty())
+  {
+    stream_ << "fingerprint " << fingerprint << '\n';
+  }
+  stream_ << "title  vts  chapters  angles  duration      fps\n";
+}
+
+void summary_table_writer::on_title_summary(title_summary const &ts)
+{
+  std::format_to(std::ostreambuf_iterator<char>{stream_}, "{:5}  {:3}  {:8}  {:6}  {}  {:3}\n", ts.title, ts.title_set,
+                 ts.chapters, ts.angles, format_timestamp(ts.duration_ms), ts.fps);
+}
+
+summary_ndjson_writer::summary_ndjson_writer(std::ostream &stream, std::string_view disc,
+                                             std::string_view fingerprint, std::pmr::memory_resource *mr)
+    : stream_(stream), disc_(json_escape(disc, mr)), fingerprint_field_(fingerprint_field(fingerprint, mr))
+{
+}
+
+void summary_ndjson_writer::on_title_summary(title_summary const &ts)
+{
+  std::format_to(std::ostreambuf_iterator<char>{stream_},
+                 R"({{"disc":"{}"{},"title":{},"title_set":{},"chapters":{},"angles":{},"duration_ms":{},"fps":{}}})"
+                 "\n",
+                 disc_, fingerprint_field_, ts.title, ts.title_set, ts.chapters, ts.angles, ts.duration_ms, ts.fps);
+}
+
+streams_ndjson_writer::streams_ndjson_writer(std::ostream &stream, std::string_view disc,
+                                             std::string_view fingerprint, std::pmr::memory_resource *mr)
+    : stream_(stream), disc_(json_escape(disc, mr)), fingerprint_field_(fingerprint_field(fingerprint, mr))
+{
+}
+
+void streams_ndjson_writer::on_title_streams(title_streams const &streams, title_chapters const &chapters)
+{
+  auto const out = std::ostreambuf_iterator<char>{stream_};
+  auto const &video = streams.video;
+  std::format_to(out, R"({{"disc":"{}"{},"title":{},"title_set":{},)", disc_, fingerprint_field_, streams.title,
+                 streams.title_set);
+  std::format_to(out, R"("video":{{"standard":"{}","aspect":"{}","width":{},"height":{},"letterboxed":{}}},"audio":[)",
+                 video.standard, video.aspect, video.width, video.height, video.letterboxed);
+  auto separator = "";
+  for (auto const &audio : streams.audio)
+  {
+    std::format_to(out, R"({}{{"stream":{},"id":{},"format":"{}","language":"{}","channels":{},"sample_rate":{}}})",
+                   separator, audio.stream, audio.id, audio.format, audio.language.data(), audio.channels,
+                   audio.sample_rate);
+    separator = ",";
+  }
+  std::format_to(out, R"(],"subpictures":[)");
+  separator = "";
+  for (auto const &subpicture : streams.subpictures)
+  {
+    std::format_to(out, R"({}{{"stream":{},"id":{},"language":"{}"}})", separator, subpicture.stream, subpicture.id,
+                   subpicture.language.data());
+    separator = ",";
+  }
+  std::format_to(out, R"(],"fps":{},"chapters_ms":[)", chapters.fps);
+  separator = "";
+  for (auto start_ms : chapters.starts_ms)
+  {
+    std::format_to(out, "{}{}", separator, start_ms);
+    separator = ",";
+  }
+  std::format_to(out, "]}}\n");
+}
+
+sector_ndjson_writer::sector_ndjson_writer(std::ostream &stream, std::string_view disc,
+                                           std::string_view fingerprint, std::pmr::memory_resource *mr)
+    : stream_(stream), disc_(json_escape(disc, mr)), fingerprint_field_(fingerprint_field(fingerprint, mr))
+{
+}
+
+void sector_ndjson_writer::on_title_sectors(title_sectors const &ts)
+{
+  auto const out = std::ostreambuf_iterator<char>{stream_};
+  for (auto const &chapter : ts.chapters)
+  {
+    std::format_to(out, R"({{"disc":"{}"{},"title":{},"title_set":{},"chapter":{},"pgc":{},"start_ms":{},"cells":[)",
+                   disc_, fingerprint_field_, ts.title, ts.title_set, chapter.chapter, chapter.pgc, chapter.start_ms);
+    auto separator = "";
+    for (auto const &cell : chapter.cells)
+    {
+      auto const first_byte = uint64_t{cell.first_sector} * DVD_VIDEO_LB_LEN;
+      auto const end_byte = (uint64_t{std::max(cell.first_sector, cell.last_sector)} + 1) * DVD_VIDEO_LB_LEN;
+      std::format_to(out, R"({}{{"cell":{},"angle":{},"interleaved":{},"first_sector":{},"last_sector":{},)",
+                     separator, cell.cell, cell.angle, cell.interleaved, cell.first_sector, cell.last_sector);
+      std::format_to(out, R"("byte_offset":{},"byte_length":{}}})", first_byte, end_byte - first_byte);
+      separator = ",";
+    }
+    std::format_to(out, "]}}\n");
+  }
+}
+} // namespace ifo2mkv
@@ -0,0 +1,349 @@
+/*
+ libifo2mkv : title and chapter information read from the IFO files of a DVD,
+ for use in other programs. ifo2mkv is a thin front end to it.
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#ifndef LIBIFO2MKV_H
+#define LIBIFO2MKV_H
+
+#include <array>
+#include <cstdarg>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <dvdread/dvd_reader.h>
+#include <dvdread/ifo_read.h>
+
+namespace ifo2mkv
+{
+// Collects what libdvdread logs while working on a disc, and prints it on
+// stderr when destroyed unless disable_report() was called.
+struct libdvdread_logger : public dvd_logger_cb
+{
+  libdvdread_logger(std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+  ~libdvdread_logger();
+
+  void disable_report()
+  {
+    do_report_messages_ = false;
+  }
+
+  // The messages collected so far, one per line.
+  std::string messages() const;
+
+  void clear_messages() noexcept
+  {
+    messages_.clear();
+  }
+
+private:
+  static void pf_log_(void *p, dvd_logger_level_t lvl, char const *fmt, va_list args);
+
+  std::pmr::vector<std::pair<dvd_logger_level_t, std::pmr::string>> messages_;
+  bool do_report_messages_ = true;
+};
+
+struct libdvdread_exception : public std::runtime_error
+{
+  libdvdread_exception(std::string const &what) : runtime_error(what)
+  {
+  }
+};
+
+struct stream_exception : public std::runtime_error
+{
+  stream_exception(std::string const &what) : runtime_error(what)
+  {
+  }
+};
+
+struct timeout_exception : public stream_exception
+{
+  timeout_exception(std::string const &what) : stream_exception(what)
+  {
+  }
+};
+
+// Thrown for problems with what is on the disc or asked of it, rather than
+// with reading it.
+struct disc_exception : public std::runtime_error
+{
+  disc_exception(std::string const &what) : runtime_error(what)
+  {
+  }
+};
+
+struct no_such_title_exception : public disc_exception
+{
+  no_such_title_exception(std::string const &what) : disc_exception(what)
+  {
+  }
+};
+
+using dvd_uptr = std::unique_ptr<dvd_reader_t, decltype(&::DVDClose)>;
+using ifo_uptr = std::unique_ptr<ifo_handle_t, decltype(&::ifoClose)>;
+
+// Title sets are shared by many titles, so each VTS IFO is opened at most once
+// per disc and kept until the disc is done. Scratch memory needed while
+// looking at the disc comes from resource().
+struct vts_cache
+{
+  vts_cache(dvd_reader_t &dvd, std::pmr::memory_resource *mr) : dvd_(dvd), handles_(mr)
+  {
+  }
+
+  ifo_handle_t &get(int title_set);
+
+  std::pmr::memory_resource *resource() const
+  {
+    return handles_.get_allocator().resource();
+  }
+
+private:
+  dvd_reader_t &dvd_;
+  std::pmr::vector<std::optional<ifo_uptr>> handles_;
+};
+
+struct title_summary
+{
+  int title;
+  int title_set;
+  unsigned chapters;
+  unsigned angles;
+  int32_t duration_ms;
+  unsigned fps;
+};
+
+struct title_chapters
+{
+  int title;
+  unsigned fps;
+  std::pmr::vector<int32_t> starts_ms; // one per chapter, the first one is always 0
+};
+
+struct cell_sectors
+{
+  int cell;         // 1-based, within the PGC
+  int angle;        // 1-based within an angle block, 0 outside of one
+  bool interleaved; // the sectors hold the ILVUs of other angles or branches too
+  uint32_t first_sector;
+  uint32_t last_sector;
+};
+
+struct chapter_sectors
+{
+  int chapter; // 1-based
+  int pgc;     // 1-based, within the title set
+  int32_t start_ms;
+  std::pmr::vector<cell_sectors> cells;
+};
+
+struct video_attributes
+{
+  std::string_view standard; // "NTSC" or "PAL"
+  std::string_view aspect;   // "4:3" or "16:9"
+  unsigned width;
+  unsigned height;
+  bool letterboxed;
+};
+
+struct audio_stream
+{
+  int stream;                   // 0-based, in the attribute table of the title set
+  int id;                       // substream id in the VOBs, 0 if unknown
+  std::string_view format;      // "ac3", "mpeg1", "mpeg2ext", "lpcm", "dts", "sdds"
+  std::array<char, 3> language; // ISO 639-1, empty if not given
+  unsigned channels;
+  unsigned sample_rate;
+};
+
+struct subpicture_stream
+{
+  int stream; // 0-based, in the attribute table of the title set
+  int id;     // substream id in the VOBs
+  std::array<char, 3> language;
+};
+
+// The streams the first PGC of a title enables, with their attributes from
+// the VTS IFO.
+struct title_streams
+{
+  int title;
+  int title_set;
+  video_attributes video;
+  std::pmr::vector<audio_stream> audio;
+  std::pmr::vector<subpicture_stream> subpictures;
+};
+
+// Where the chapters of a title lie in its title set's VOBs (VTS_XX_1.VOB
+// onwards, read as one file), in DVD_VIDEO_LB_LEN byte sectors.
+struct title_sectors
+{
+  int title;
+  int title_set;
+  std::pmr::vector<chapter_sectors> chapters;
+};
+
+enum class chapter_times
+{
+  ifo,       // summed up from the cell playback times in the IFOs
+  nav_packs, // from the presentation times in the NAV packs of the VOBs
+};
+
+enum class fingerprint_kind
+{
+  crc64,   // over the sizes of the files of every title set and the IFOs
+  disc_id, // libdvdread's DVDDiscID(), an MD5 over the first IFOs
+};
+
+// An input read through a stream rather than by libdvdread itself, see
+// libifo2mkv_internal.h.
+struct dvd_stream;
+// What DVDOpenStream2 is handed for a disc read through a stream.
+struct stream_context;
+
+// An open DVD : its VMG, and the VTS IFOs that titles are looked up in. Titles
+// are passed as 0-based indices into the title table. What is allocated for
+// the disc, including the chapter vectors handed out, comes from mr.
+struct disc
+{
+  // stream may be nullptr, see make_stream().
+  disc(char const *path, dvd_stream *stream, libdvdread_logger &logger,
+       std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+  ~disc();
+
+  int num_titles() const;
+
+  // Chapter times from the IFOs are rounded to whole frames per cell, which
+  // adds up over long titles. Taking them from the NAV packs is exact, at the
+  // cost of reading two sectors per cell, which a disc read from a pipe does
+  // not allow for.
+  title_chapters chapters(int title, chapter_times times = chapter_times::ifo);
+  title_summary summary(int title);
+  title_sectors sectors(int title);
+  title_streams streams(int title);
+
+  // Identifies the disc independently of where it is, e.g.
+  // "crc64:0123456789abcdef".
+  std::string fingerprint(fingerprint_kind kind);
+
+  // Hash of the structure of a title (chapters, cells and their lengths),
+  // which copies of the title on other discs share.
+  uint64_t title_signature(int title);
+
+  // Extracts the VOB data of a title to out in playback order, reading it in
+  // large sequential chunks. The data is left as the MPEG program stream it is
+  // on the disc, nothing is demuxed. Of angle blocks only the first angle is copied.
+  // Interleaved cells are copied VOBU by VOBU, following the links in their
+  // NAV packs, so that the ILVUs of other angles and branches are left out.
+  // Not possible for a disc read from a pipe.
+  void copy_title_vobs(int title, std::ostream &out);
+
+  // Returns a per-title vector which is true for titles that look like
+  // decoys, reporting each of them together with the reasons on report.
+  std::vector<bool> find_decoy_titles(std::ostream &report);
+
+  // Returns the title that is most likely the main feature, ignoring the
+  // ones skip is true for, or -1 if there is none.
+  int find_main_title(std::vector<bool> const &skip);
+
+private:
+  void check_title(int title) const;
+  // Throws if the disc is read from a stream that cannot go back to the VOBs.
+  void check_seekable(std::string_view what) const;
+
+  std::unique_ptr<stream_context> stream_context_;
+  dvd_uptr dvd_;
+  ifo_uptr vmg_;
+  vts_cache vtss_;
+};
+
+// Escapes str for use within a JSON string.
+std::string json_escape(std::string_view str);
+
+struct matroska_chapter_xml_writer
+{
+  // The fingerprint, if any, is written as a comment.
+  matroska_chapter_xml_writer(std::ostream &stream, std::string_view fingerprint = {});
+  ~matroska_chapter_xml_writer();
+
+  // Writes one edition holding the chapters of a title.
+  void on_title_chapters(title_chapters const &chapters);
+
+private:
+  std::mt19937_64 rnd_gen_;
+  std::ostream &stream_;
+};
+
+struct summary_table_writer
+{
+  summary_table_writer(std::ostream &stream, std::string_view fingerprint = {});
+
+  void on_title_summary(title_summary const &ts);
+
+private:
+  std::ostream &stream_;
+};
+
+// One JSON object per title and line, each carrying the disc path (and
+// fingerprint, if given) so that the output of many discs can simply be
+// concatenated.
+struct summary_ndjson_writer
+{
+  summary_ndjson_writer(std::ostream &stream, std::string_view disc, std::string_view fingerprint = {},
+                        std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+
+  void on_title_summary(title_summary const &ts);
+
+private:
+  std::ostream &stream_;
+  std::pmr::string disc_;
+  std::pmr::string fingerprint_field_;
+};
+
+// One JSON object per title and line, holding its streams along with its
+// chapters : all that is needed to mux the title with track languages.
+struct streams_ndjson_writer
+{
+  streams_ndjson_writer(std::ostream &stream, std::string_view disc, std::string_view fingerprint = {},
+                        std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+
+  void on_title_streams(title_streams const &streams, title_chapters const &chapters);
+
+private:
+  std::ostream &stream_;
+  std::pmr::string disc_;
+  std::pmr::string fingerprint_field_;
+};
+
+// One JSON object per chapter and line, listing its cells with their sector
+// ranges and the matching byte ranges, so that a chapter can be cut out of
+// the VOBs without scanning them.
+struct sector_ndjson_writer
+{
+  sector_ndjson_writer(std::ostream &stream, std::string_view disc, std::string_view fingerprint = {},
+                       std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+
+  void on_title_sectors(title_sectors const &ts);
+
+private:
+  std::ostream &stream_;
+  std::pmr::string disc_;
+  std::pmr::string fingerprint_field_;
+};
+} // namespace ifo2mkv
+
+#endif
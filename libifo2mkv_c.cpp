@@ -0,0 +1,260 @@
+/*
+ C interface to libifo2mkv.
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libifo2mkv_c.h"
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "libifo2mkv_internal.h"
+
+namespace
+{
+// Nothing is printed from within the library, errors come with the status.
+struct quiet_logger : public ifo2mkv::libdvdread_logger
+{
+  quiet_logger()
+  {
+    disable_report();
+  }
+};
+} // namespace
+
+struct ifo2mkv_disc
+{
+  ifo2mkv_disc(char const *path)
+      : stream(ifo2mkv::make_stream(path, std::nullopt)), handle(path, stream.get(), logger)
+  {
+  }
+
+  std::mutex mutex;
+  // libdvdread keeps pointers to the logger and the stream, both have to
+  // outlive the handle.
+  quiet_logger logger;
+  std::unique_ptr<ifo2mkv::dvd_stream> stream;
+  ifo2mkv::disc handle;
+  std::string last_error;
+};
+
+namespace
+{
+size_t copy_string(std::string_view str, char *buffer, size_t size)
+{
+  if (buffer && size > 0)
+  {
+    auto const n = std::min(str.size(), size - 1);
+    std::memcpy(buffer, str.data(), n);
+    buffer[n] = '\0';
+  }
+  return str.size();
+}
+
+// Runs fn, turning whatever it throws into a status and a message.
+template <typename Fn> ifo2mkv_status guarded(std::string &error, Fn &&fn) noexcept
+{
+  try
+  {
+    try
+    {
+      fn();
+      return IFO2MKV_OK;
+    }
+    catch (ifo2mkv::no_such_title_exception const &e)
+    {
+      error = e.what();
+      return IFO2MKV_NO_SUCH_TITLE;
+    }
+    catch (ifo2mkv::disc_exception const &e)
+    {
+      error = e.what();
+      return IFO2MKV_DISC_ERROR;
+    }
+    catch (ifo2mkv::libdvdread_exception const &e)
+    {
+      error = e.what();
+      return IFO2MKV_DVD_READ_ERROR;
+    }
+    catch (ifo2mkv::stream_exception const &e)
+    {
+      error = e.what();
+      return IFO2MKV_INPUT_ERROR;
+    }
+    catch (std::bad_alloc const &)
+    {
+      error = "Out of memory";
+      return IFO2MKV_OUT_OF_MEMORY;
+    }
+    catch (std::exception const &e)
+    {
+      error = e.what();
+      return IFO2MKV_INTERNAL_ERROR;
+    }
+    catch (...)
+    {
+      error = "Unknown error";
+      return IFO2MKV_INTERNAL_ERROR;
+    }
+  }
+  catch (...)
+  {
+    // Storing the message failed, which leaves nothing to report it with.
+    return IFO2MKV_OUT_OF_MEMORY;
+  }
+}
+
+template <typename Fn> ifo2mkv_status with_disc(ifo2mkv_disc *disc, Fn &&fn) noexcept
+{
+  if (!disc)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  auto const lock = std::lock_guard{disc->mutex};
+  disc->last_error.clear();
+  auto const status = guarded(disc->last_error, [&] { fn(disc->handle); });
+  // libdvdread often explains a failure in its log only, so its messages go
+  // with the error. They are dropped after every call, as they would pile up
+  // over the lifetime of the handle otherwise.
+  if (status != IFO2MKV_OK)
+  {
+    guarded(disc->last_error, [&] {
+      if (auto const messages = disc->logger.messages(); !messages.empty())
+      {
+        disc->last_error += std::format("\n{}", std::string_view{messages}.substr(0, messages.size() - 1));
+      }
+    });
+  }
+  disc->logger.clear_messages();
+  return status;
+}
+} // namespace
+
+extern "C"
+{
+char const *ifo2mkv_status_string(ifo2mkv_status status)
+{
+  switch (status)
+  {
+  case IFO2MKV_OK:
+    return "Success";
+  case IFO2MKV_INVALID_ARGUMENT:
+    return "Invalid argument";
+  case IFO2MKV_NO_SUCH_TITLE:
+    return "No such title";
+  case IFO2MKV_BUFFER_TOO_SMALL:
+    return "Buffer too small";
+  case IFO2MKV_DVD_READ_ERROR:
+    return "DVD read error";
+  case IFO2MKV_INPUT_ERROR:
+    return "Input error";
+  case IFO2MKV_OUT_OF_MEMORY:
+    return "Out of memory";
+  case IFO2MKV_INTERNAL_ERROR:
+    return "Internal error";
+  case IFO2MKV_DISC_ERROR:
+    return "Invalid disc structure";
+  }
+  return "Unknown status";
+}
+
+ifo2mkv_status ifo2mkv_disc_open(char const *path, ifo2mkv_disc **disc, char *error, size_t error_size)
+{
+  if (!disc)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  *disc = nullptr;
+  if (!path)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  auto message = std::string{};
+  auto const status = guarded(message, [&] { *disc = new ifo2mkv_disc{path}; });
+  copy_string(message, error, error_size);
+  return status;
+}
+
+void ifo2mkv_disc_close(ifo2mkv_disc *disc)
+{
+  delete disc;
+}
+
+size_t ifo2mkv_disc_last_error(ifo2mkv_disc *disc, char *buffer, size_t size)
+{
+  if (!disc)
+  {
+    return copy_string({}, buffer, size);
+  }
+  auto const lock = std::lock_guard{disc->mutex};
+  return copy_string(disc->last_error, buffer, size);
+}
+
+ifo2mkv_status ifo2mkv_disc_num_titles(ifo2mkv_disc *disc, int32_t *num_titles)
+{
+  if (!num_titles)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  return with_disc(disc, [&](ifo2mkv::disc &d) { *num_titles = d.num_titles(); });
+}
+
+ifo2mkv_status ifo2mkv_disc_title_info(ifo2mkv_disc *disc, int32_t title, ifo2mkv_title_info *info)
+{
+  if (!info)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  return with_disc(disc, [&](ifo2mkv::disc &d) {
+    auto const ts = d.summary(title);
+    *info = {ts.title, ts.title_set, ts.chapters, ts.angles, ts.duration_ms, ts.fps};
+  });
+}
+
+ifo2mkv_status ifo2mkv_disc_chapters(ifo2mkv_disc *disc, int32_t title, int32_t *starts_ms, size_t *count,
+                                     uint32_t *fps)
+{
+  if (!count || (!starts_ms && *count > 0))
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  auto too_small = false;
+  auto const status = with_disc(disc, [&](ifo2mkv::disc &d) {
+    auto const chapters = d.chapters(title);
+    too_small = chapters.starts_ms.size() > *count;
+    if (!too_small)
+    {
+      std::copy(chapters.starts_ms.begin(), chapters.starts_ms.end(), starts_ms);
+      if (fps)
+      {
+        *fps = chapters.fps;
+      }
+    }
+    *count = chapters.starts_ms.size();
+  });
+  return status == IFO2MKV_OK && too_small ? IFO2MKV_BUFFER_TOO_SMALL : status;
+}
+
+ifo2mkv_status ifo2mkv_disc_main_title(ifo2mkv_disc *disc, int skip_decoys, int32_t *title)
+{
+  if (!title)
+  {
+    return IFO2MKV_INVALID_ARGUMENT;
+  }
+  return with_disc(disc, [&](ifo2mkv::disc &d) {
+    // The reasons titles are skipped for are of no interest here.
+    auto report = std::ostringstream{};
+    auto const skip = skip_decoys ? d.find_decoy_titles(report) : std::vector<bool>(d.num_titles());
+    *title = d.find_main_title(skip);
+  });
+}
+}
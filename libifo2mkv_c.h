@@ -0,0 +1,93 @@
+/*
+ C interface to libifo2mkv, for calling it from other languages (ctypes, cffi,
+ cgo...). No exception crosses it : every function reports failure through
+ its return value, and all output goes to buffers provided by the caller. The
+ functions taking a disc handle may be called from several threads at once,
+ calls on the same handle are serialized.
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#ifndef LIBIFO2MKV_C_H
+#define LIBIFO2MKV_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The library is built with hidden visibility, only these functions are
+   exported. */
+#if defined(__GNUC__)
+#define IFO2MKV_API __attribute__((visibility("default")))
+#else
+#define IFO2MKV_API
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum ifo2mkv_status
+{
+  IFO2MKV_OK = 0,
+  IFO2MKV_INVALID_ARGUMENT,
+  IFO2MKV_NO_SUCH_TITLE,
+  IFO2MKV_BUFFER_TOO_SMALL,
+  IFO2MKV_DVD_READ_ERROR,
+  IFO2MKV_INPUT_ERROR,
+  IFO2MKV_OUT_OF_MEMORY,
+  IFO2MKV_INTERNAL_ERROR,
+  IFO2MKV_DISC_ERROR, /* the disc is read fine, but its structure is broken */
+} ifo2mkv_status;
+
+typedef struct ifo2mkv_disc ifo2mkv_disc;
+
+typedef struct ifo2mkv_title_info
+{
+  int32_t title; /* 1-based, as shown by DVD players */
+  int32_t title_set;
+  uint32_t chapters;
+  uint32_t angles;
+  int32_t duration_ms;
+  uint32_t fps;
+} ifo2mkv_title_info;
+
+/* Returns a static description of status. */
+IFO2MKV_API char const *ifo2mkv_status_string(ifo2mkv_status status);
+
+/* Opens the VIDEO_TS folder or image at path. On failure *disc is set to NULL
+   and, if error is not NULL, a description of the problem is written to it,
+   truncated to error_size bytes including the terminating NUL. */
+IFO2MKV_API ifo2mkv_status ifo2mkv_disc_open(char const *path, ifo2mkv_disc **disc, char *error, size_t error_size);
+
+IFO2MKV_API void ifo2mkv_disc_close(ifo2mkv_disc *disc);
+
+/* Copies the description of the last failed call on disc, followed by what
+   libdvdread logged during it, into buffer like snprintf does, returning the
+   length of the full description. */
+IFO2MKV_API size_t ifo2mkv_disc_last_error(ifo2mkv_disc *disc, char *buffer, size_t size);
+
+IFO2MKV_API ifo2mkv_status ifo2mkv_disc_num_titles(ifo2mkv_disc *disc, int32_t *num_titles);
+
+/* Titles are 0-based indices into the title table. */
+IFO2MKV_API ifo2mkv_status ifo2mkv_disc_title_info(ifo2mkv_disc *disc, int32_t title, ifo2mkv_title_info *info);
+
+/* Writes the start time of every chapter of title to starts_ms, which holds
+   *count entries. *count is set to the number of chapters; if that is more
+   than fit, nothing is written and IFO2MKV_BUFFER_TOO_SMALL is returned. fps
+   may be NULL. */
+IFO2MKV_API ifo2mkv_status ifo2mkv_disc_chapters(ifo2mkv_disc *disc, int32_t title, int32_t *starts_ms,
+                                                 size_t *count, uint32_t *fps);
+
+/* Sets *title to the title that most likely is the main feature, or -1 if
+   there is none. With skip_decoys non-zero, titles that look like copy
+   protection decoys are not considered. */
+IFO2MKV_API ifo2mkv_status ifo2mkv_disc_main_title(ifo2mkv_disc *disc, int skip_decoys, int32_t *title);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ Exercises the C interface to libifo2mkv and checks that calling it does not
+ leak : once a few rounds of calls have warmed up the caches, the heap may not
+ grow over many more rounds. Run as "make check DISC=path" to go through every
+ title of a disc, on a handle kept open throughout as well as on one opened
+ per round; without a disc only the error paths are exercised.
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libifo2mkv_c.h"
+
+enum
+{
+  warmup_rounds = 10,
+  rounds = 1000,
+};
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+  do                                                                                                                   \
+  {                                                                                                                    \
+    if (!(cond))                                                                                                       \
+    {                                                                                                                  \
+      fprintf(stderr, "%s:%d : check failed : %s\n", __FILE__, __LINE__, #cond);                                      \
+      ++failures;                                                                                                      \
+    }                                                                                                                  \
+  } while (0)
+
+static void check_errors(void)
+{
+  ifo2mkv_disc *disc = (ifo2mkv_disc *)&disc;
+  char error[256] = "";
+  int32_t num_titles = 0;
+
+  CHECK(ifo2mkv_disc_open("/nonexistent/VIDEO_TS", &disc, error, sizeof(error)) != IFO2MKV_OK);
+  CHECK(disc == NULL);
+  CHECK(error[0] != '\0');
+  CHECK(ifo2mkv_disc_open(NULL, &disc, NULL, 0) == IFO2MKV_INVALID_ARGUMENT);
+  CHECK(ifo2mkv_disc_num_titles(NULL, &num_titles) == IFO2MKV_INVALID_ARGUMENT);
+  CHECK(ifo2mkv_disc_last_error(NULL, error, sizeof(error)) == 0);
+  CHECK(strcmp(ifo2mkv_status_string(IFO2MKV_OK), "Success") == 0);
+  CHECK(strcmp(ifo2mkv_status_string(IFO2MKV_DISC_ERROR), "Unknown status") != 0);
+  ifo2mkv_disc_close(NULL);
+}
+
+static void check_disc(ifo2mkv_disc *disc)
+{
+  int32_t num_titles = 0;
+  int32_t main_title = -1;
+  char error[256] = "";
+
+  CHECK(ifo2mkv_disc_num_titles(disc, &num_titles) == IFO2MKV_OK);
+  for (int32_t t = 0; t < num_titles; ++t)
+  {
+    ifo2mkv_title_info info;
+    CHECK(ifo2mkv_disc_title_info(disc, t, &info) == IFO2MKV_OK);
+    CHECK(info.title == t + 1);
+
+    size_t count = 0;
+    ifo2mkv_status const status = ifo2mkv_disc_chapters(disc, t, NULL, &count, NULL);
+    CHECK(status == (count > 0 ? IFO2MKV_BUFFER_TOO_SMALL : IFO2MKV_OK));
+    int32_t *starts_ms = malloc((count + 1) * sizeof(*starts_ms));
+    CHECK(ifo2mkv_disc_chapters(disc, t, starts_ms, &count, NULL) == IFO2MKV_OK);
+    CHECK(count == 0 || starts_ms[0] == 0);
+    free(starts_ms);
+  }
+
+  ifo2mkv_title_info info;
+  CHECK(ifo2mkv_disc_title_info(disc, num_titles, &info) == IFO2MKV_NO_SUCH_TITLE);
+  CHECK(ifo2mkv_disc_last_error(disc, error, sizeof(error)) > 0);
+  CHECK(ifo2mkv_disc_main_title(disc, 0, &main_title) == IFO2MKV_OK);
+  CHECK(ifo2mkv_disc_main_title(disc, 1, &main_title) == IFO2MKV_OK);
+}
+
+static void run_round(char const *path, ifo2mkv_disc *kept)
+{
+  check_errors();
+  if (!path)
+  {
+    return;
+  }
+  check_disc(kept);
+
+  ifo2mkv_disc *disc = NULL;
+  char error[256] = "";
+  CHECK(ifo2mkv_disc_open(path, &disc, error, sizeof(error)) == IFO2MKV_OK);
+  if (disc)
+  {
+    check_disc(disc);
+    ifo2mkv_disc_close(disc);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  char const *path = argc > 1 ? argv[1] : NULL;
+  ifo2mkv_disc *kept = NULL;
+  if (path)
+  {
+    char error[256] = "";
+    if (ifo2mkv_disc_open(path, &kept, error, sizeof(error)) != IFO2MKV_OK)
+    {
+      fprintf(stderr, "Could not open %s : %s\n", path, error);
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < warmup_rounds; ++i)
+  {
+    run_round(path, kept);
+  }
+  size_t const before = mallinfo2().uordblks;
+  for (int i = 0; i < rounds; ++i)
+  {
+    run_round(path, kept);
+  }
+  size_t const after = mallinfo2().uordblks;
+  // Less than a byte per round cannot be a leak of any call.
+  if (after > before && after - before >= rounds)
+  {
+    fprintf(stderr, "Heap grew by %zu bytes over %d rounds\n", after - before, rounds);
+    ++failures;
+  }
+  ifo2mkv_disc_close(kept);
+
+  if (failures > 0)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("%s : all checks passed\n", path ? path : "no disc");
+  return 0;
+}
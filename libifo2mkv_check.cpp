@@ -0,0 +1,259 @@
+/*
+ Checks of libifo2mkv that need no disc : reading inputs through the stream
+ layer, with libdvdread logging while it does, and reading images over HTTP
+ from a stand-in server on the loopback interface. Run as part of "make check".
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include <charconv>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libifo2mkv_internal.h"
+
+namespace
+{
+int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+  do                                                                                                                   \
+  {                                                                                                                    \
+    if (!(cond))                                                                                                       \
+    {                                                                                                                  \
+      std::cerr << __FILE__ << ":" << __LINE__ << " : check failed : " << #cond << '\n';                               \
+      ++failures;                                                                                                      \
+    }                                                                                                                  \
+  } while (0)
+
+// A file that is no DVD image, removed again when done with.
+struct garbage_image
+{
+  garbage_image()
+  {
+    auto fd = ifo2mkv::unique_fd{::mkstemp(path.data())};
+    CHECK(fd.get() >= 0);
+    auto const block = std::string(DVD_VIDEO_LB_LEN, 'X');
+    for (auto i = 0; i < 64; ++i)
+    {
+      CHECK(::write(fd.get(), block.data(), block.size()) == static_cast<ssize_t>(block.size()));
+    }
+  }
+  ~garbage_image()
+  {
+    ::unlink(path.c_str());
+  }
+
+  std::string path = "/tmp/libifo2mkv_check_XXXXXX";
+};
+
+// libdvdread logs through the same private pointer it reads the stream
+// through. A deadline makes even a plain image file go through a stream.
+void check_stream_logging()
+{
+  auto const image = garbage_image{};
+  auto logger = ifo2mkv::libdvdread_logger{};
+  logger.disable_report();
+  auto const stream =
+      ifo2mkv::make_stream(image.path.c_str(), ifo2mkv::deadline_clock::now() + std::chrono::minutes{1});
+  CHECK(stream != nullptr);
+  auto thrown = false;
+  try
+  {
+    auto const dvd = ifo2mkv::disc{image.path.c_str(), stream.get(), logger};
+  }
+  catch (ifo2mkv::libdvdread_exception const &)
+  {
+    thrown = true;
+  }
+  CHECK(thrown);
+  CHECK(!logger.messages().empty());
+}
+
+uint8_t image_byte(uint64_t pos)
+{
+  return static_cast<uint8_t>(pos * 7 % 251);
+}
+
+// Serves an image of image_size bytes, one request per connection, like
+// different kinds of servers do depending on the path : /ranges answers Range
+// requests, /no-accept-ranges too but without announcing it, and /no-ranges
+// always sends the whole image.
+struct http_stand_in
+{
+  static constexpr uint64_t image_size = 100'000;
+
+  http_stand_in() : listen_fd_(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+  {
+    auto addr = ::sockaddr_in{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    auto len = ::socklen_t{sizeof(addr)};
+    CHECK(::bind(listen_fd_.get(), reinterpret_cast<::sockaddr *>(&addr), len) == 0);
+    CHECK(::listen(listen_fd_.get(), 8) == 0);
+    CHECK(::getsockname(listen_fd_.get(), reinterpret_cast<::sockaddr *>(&addr), &len) == 0);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::jthread{[this] { serve(); }};
+  }
+  ~http_stand_in()
+  {
+    ::shutdown(listen_fd_.get(), SHUT_RDWR);
+  }
+
+  std::string url(std::string_view path) const
+  {
+    return std::format("http://127.0.0.1:{}{}", port_, path);
+  }
+
+private:
+  void serve()
+  {
+    for (;;)
+    {
+      auto const conn = ifo2mkv::unique_fd{::accept4(listen_fd_.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+      if (conn.get() < 0)
+      {
+        return;
+      }
+      auto request = std::string{};
+      char buf[4096];
+      while (request.find("\r\n\r\n") == std::string::npos)
+      {
+        auto const n = ::read(conn.get(), buf, sizeof(buf));
+        if (n <= 0)
+        {
+          break;
+        }
+        request.append(buf, static_cast<size_t>(n));
+      }
+      respond(conn.get(), request);
+    }
+  }
+
+  static void respond(int fd, std::string_view request)
+  {
+    auto const path = request.substr(4, request.find(' ', 4) - 4);
+    auto first = uint64_t{0};
+    auto last = image_size - 1;
+    constexpr auto range_header = std::string_view{"Range: bytes="};
+    auto const range = request.find(range_header);
+    auto const ranged = range != std::string_view::npos && path != "/no-ranges";
+    if (ranged)
+    {
+      auto const end = request.data() + request.size();
+      auto const dash = std::from_chars(request.data() + range + range_header.size(), end, first).ptr;
+      std::from_chars(dash + 1, end, last);
+    }
+
+    auto response = std::string{};
+    if (ranged && first >= image_size)
+    {
+      response = std::format("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */{}\r\n"
+                             "Content-Length: 0\r\nConnection: close\r\n\r\n",
+                             image_size);
+    }
+    else
+    {
+      last = std::min(last, image_size - 1);
+      response = ranged ? std::format("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes {}-{}/{}\r\n", first,
+                                      last, image_size)
+                        : std::string{"HTTP/1.1 200 OK\r\n"};
+      if (path == "/ranges")
+      {
+        response += "Accept-Ranges: bytes\r\n";
+      }
+      response += std::format("Content-Length: {}\r\nConnection: close\r\n\r\n", last - first + 1);
+      for (auto pos = first; pos <= last; ++pos)
+      {
+        response += static_cast<char>(image_byte(pos));
+      }
+    }
+    for (auto sent = size_t{0}; sent < response.size();)
+    {
+      auto const n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+      {
+        return;
+      }
+      sent += static_cast<size_t>(n);
+    }
+  }
+
+  ifo2mkv::unique_fd listen_fd_;
+  uint16_t port_ = 0;
+  std::jthread thread_;
+};
+
+// Reads size bytes at pos, checking that what arrives is the image's.
+int read_image(ifo2mkv::dvd_stream &stream, uint64_t pos, int size)
+{
+  auto buffer = std::string(static_cast<size_t>(size), '\0');
+  stream.seek(pos);
+  auto const n = stream.read(buffer.data(), size);
+  for (auto i = 0; i < n; ++i)
+  {
+    if (static_cast<uint8_t>(buffer[static_cast<size_t>(i)]) != image_byte(pos + static_cast<uint64_t>(i)))
+    {
+      std::cerr << std::format("Byte {} differs\n", pos + static_cast<uint64_t>(i));
+      return -1;
+    }
+  }
+  return n;
+}
+
+void check_http_ranges()
+{
+  auto const server = http_stand_in{};
+  constexpr auto size = http_stand_in::image_size;
+
+  auto const stream = ifo2mkv::make_stream(server.url("/ranges").c_str(), std::nullopt);
+  CHECK(stream != nullptr);
+  CHECK(read_image(*stream, 0, 2048) == 2048);
+  // Spans several blocks, part of which are cached already.
+  CHECK(read_image(*stream, 1000, 70'000) == 70'000);
+  // Runs past the end of the image, of which the size is only known now.
+  CHECK(read_image(*stream, size - 300, 1000) == 300);
+  CHECK(read_image(*stream, size + 10, 100) == 0);
+  CHECK(read_image(*stream, 40'000, 100) == 100);
+
+  // Accept-Ranges is a hint only, what counts is the 206.
+  auto const unannounced = ifo2mkv::make_stream(server.url("/no-accept-ranges").c_str(), std::nullopt);
+  CHECK(read_image(*unannounced, 50, 4096) == 4096);
+
+  // A server sending the whole image is given up on rather than downloaded.
+  auto const whole = ifo2mkv::make_stream(server.url("/no-ranges").c_str(), std::nullopt);
+  auto thrown = false;
+  try
+  {
+    read_image(*whole, 0, 2048);
+  }
+  catch (ifo2mkv::stream_exception const &e)
+  {
+    thrown = std::string_view{e.what()}.ends_with("does not support range requests");
+  }
+  CHECK(thrown);
+}
+} // namespace
+
+int main()
+{
+  check_stream_logging();
+  check_http_ranges();
+
+  if (failures > 0)
+  {
+    std::cerr << failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ Parts of libifo2mkv shared by the library and the ifo2mkv front end, but not
+ part of the interface of libifo2mkv.h : the inputs read through streams, and
+ the tracing and profiling of batch runs.
+
+ Distributed under the GPL v2
+ see the file COPYING for details
+ or visit https://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#ifndef LIBIFO2MKV_INTERNAL_H
+#define LIBIFO2MKV_INTERNAL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libifo2mkv.h"
+
+namespace ifo2mkv
+{
+struct unique_fd
+{
+  explicit unique_fd(int fd) : fd_(fd)
+  {
+  }
+  unique_fd(unique_fd &&other) noexcept : fd_(std::exchange(other.fd_, -1))
+  {
+  }
+  unique_fd &operator=(unique_fd &&other) noexcept
+  {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+  ~unique_fd()
+  {
+    if (fd_ >= 0)
+    {
+      ::close(fd_);
+    }
+  }
+
+  int get() const
+  {
+    return fd_;
+  }
+
+private:
+  int fd_;
+};
+
+unique_fd open_file(char const *path, int flags = O_RDONLY);
+
+// Base for inputs that libdvdread cannot read by itself. The stream is handed
+// over to DVDOpenStream2, which drives it through plain seek/read callbacks
+// with byte positions. Callbacks must not throw, so errors are mapped to -1.
+struct dvd_stream
+{
+  virtual ~dvd_stream() = default;
+
+  virtual void seek(uint64_t pos) = 0;
+  virtual int read(void *buffer, int size) = 0;
+
+  // Whether reading failed because the stream ran past its deadline.
+  virtual bool timed_out() const
+  {
+    return false;
+  }
+
+  // Whether the stream can only be read front to back, which makes disc read
+  // the IFOs of all title sets up front, in the order they are laid out in.
+  virtual bool forward_only() const
+  {
+    return false;
+  }
+};
+
+
+using deadline_clock = std::chrono::steady_clock;
+
+// Returns the stream to read the disc at path through, or nullptr if
+// libdvdread should open it directly. A path of "-" reads an image from stdin,
+// an http:// or https:// URL an image served with support for Range requests.
+// Images read under a deadline always go through a stream, as that is where
+// the deadline is enforced; libdvdread reads VIDEO_TS folders itself, those
+// can only be checked between titles. With direct_io, image files and block
+// devices are read with O_DIRECT, bypassing the page cache.
+std::unique_ptr<dvd_stream> make_stream(char const *path, std::optional<deadline_clock::time_point> deadline,
+                                        bool direct_io = false);
+
+// Has the kernel start reading the IFOs of the disc at path into the page
+// cache, without waiting for them, ahead of the disc being opened. Opening a
+// disc does the same by itself; this is for getting the IFOs of the discs
+// after it under way. Errors are ignored, as are inputs make_stream() returns
+// a stream for other than with a deadline. Discs read with direct_io bypass the
+// page cache, so there is no point in this for them.
+void prefetch_ifos(char const *path);
+
+// Records spans in the Chrome trace event format, viewable in Perfetto or
+// chrome://tracing. Every thread records into a buffer of its own, so that
+// recording a span is no more than two clock reads and a push_back; the
+// buffers are only written out by finish(). Several processes can share one
+// trace file : the one that creates it writes the opening bracket, everyone
+// appends their events in a single write, and the last writer closes the
+// array.
+struct trace_recorder
+{
+  static trace_recorder &instance();
+
+  void open(char const *path, bool create);
+
+  bool enabled() const
+  {
+    return fd_.has_value();
+  }
+
+  void set_thread_name(std::string name);
+
+  // Tags the spans subsequently recorded by the calling thread with a disc.
+  void set_disc(std::string_view disc);
+
+  void record(char const *name, int64_t start_us, int64_t end_us, char const *arg_name, int arg);
+
+  static int64_t now_us()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Writes out the buffers of all threads, which must not record anything
+  // anymore. If last is true, the trace is closed.
+  void finish(bool last);
+
+private:
+  struct trace_event
+  {
+    char const *name;
+    int64_t start_us;
+    int64_t duration_us;
+    size_t disc; // into the discs of the thread's buffer
+    char const *arg_name;
+    int arg;
+  };
+
+  struct thread_buffer
+  {
+    unsigned tid;
+    std::string name;
+    // The discs the thread has worked on, JSON escaped, the last being the
+    // current one. Events refer to them so as not to copy the name each.
+    std::vector<std::string> discs{std::string{}};
+    std::vector<trace_event> events;
+  };
+
+  thread_buffer &buffer();
+  void write_all(std::string_view data);
+
+  std::optional<unique_fd> fd_;
+  pid_t pid_ = 0;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<thread_buffer>> buffers_;
+};
+
+struct trace_span
+{
+  trace_span(char const *name, char const *arg_name = nullptr, int arg = 0)
+      : name_(trace_recorder::instance().enabled() ? name : nullptr), arg_name_(arg_name), arg_(arg),
+        start_us_(name_ ? trace_recorder::now_us() : 0)
+  {
+  }
+  trace_span(trace_span const &) = delete;
+  trace_span &operator=(trace_span const &) = delete;
+  ~trace_span()
+  {
+    if (name_)
+    {
+      trace_recorder::instance().record(name_, start_us_, trace_recorder::now_us(), arg_name_, arg_);
+    }
+  }
+
+private:
+  char const *name_;
+  char const *arg_name_;
+  int arg_;
+  int64_t start_us_;
+};
+
+enum perf_counter : size_t
+{
+  perf_cycles,
+  perf_instructions,
+  perf_cache_misses,
+  perf_context_switches,
+  perf_page_faults,
+  num_perf_counters,
+};
+
+enum perf_phase : size_t
+{
+  perf_open,
+  perf_parse,
+  perf_compute,
+  perf_write,
+  num_perf_phases,
+};
+
+constexpr std::string_view perf_phase_names[num_perf_phases] = {"open", "parse", "compute", "write"};
+
+// A counter the system does not let us read is left unset.
+using perf_values = std::array<std::optional<uint64_t>, num_perf_counters>;
+using perf_phases = std::array<perf_values, num_perf_phases>;
+
+void add_counts(perf_values &total, perf_values const &delta);
+perf_values diff_counts(perf_values const &after, perf_values const &before);
+
+// Attributes what the calling thread counts while working on a disc to the
+// phase it is in. Phases nest, the innermost one gets the counts : opening a
+// VTS IFO on demand while computing chapters is parse work, not compute work.
+struct perf_profiler
+{
+  static perf_profiler &instance();
+
+  void enable()
+  {
+    enabled_ = true;
+  }
+
+  bool enabled() const
+  {
+    return enabled_;
+  }
+
+  // Current counts of the calling thread, outside of any phase bookkeeping.
+  perf_values read_thread() const;
+
+  void begin_disc();
+  perf_phases end_disc();
+
+  // Enters phase, returning the one to go back to, if counting at all.
+  std::optional<std::optional<perf_phase>> enter(perf_phase phase);
+  void leave(std::optional<perf_phase> previous);
+
+private:
+  bool enabled_ = false;
+};
+
+struct perf_scope
+{
+  perf_scope(perf_phase phase) : previous_(perf_profiler::instance().enter(phase))
+  {
+  }
+  perf_scope(perf_scope const &) = delete;
+  perf_scope &operator=(perf_scope const &) = delete;
+  ~perf_scope()
+  {
+    if (previous_)
+    {
+      perf_profiler::instance().leave(*previous_);
+    }
+  }
+
+private:
+  std::optional<std::optional<perf_phase>> previous_;
+};
+} // namespace ifo2mkv
+
+#endif